@@ -15,6 +15,28 @@
 #include <stdio.h>
 #include <stdexcept>
 #include <chrono>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <tuple>
+#include <type_traits>
+#include <numeric>
+#include <mutex>
+#include <unordered_map>
+
+#if defined (__AVX__)
+    #include <immintrin.h>
+#endif
+
+#if defined (_WIN32)
+    #define NOMINMAX
+    #include <windows.h>
+#else
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
 
 #define PI 3.1415926535897932384626433832795028841971693993751058209749445923078164062862089986280348253421170679821
 
@@ -85,6 +107,34 @@ Vector cross(const Vector& a, const Vector& b) {
 
 Vector uvec(double x){return Vector(x,x,x);}
 
+void min_vec(Vector &to_min, Vector b){
+    for (int i=0; i<3; ++i){
+        to_min[i] = std::min(to_min[i], b[i]);
+    }
+}
+
+void max_vec(Vector &to_max, Vector b){
+    for (int i=0; i<3; ++i){
+        to_max[i] = std::max(to_max[i], b[i]);
+    }
+}
+
+void tangent_frame(const Vector& N, Vector& T1, Vector& T2){
+    // Two unit vectors completing the unit vector N into an orthonormal basis
+    if (abs(N.data[0]) <= abs(N.data[1]) && abs(N.data[0]) <= abs(N.data[2])){
+        T1 = Vector(0, -N.data[2], N.data[1]);
+    }
+    else if (abs(N.data[1]) <= abs(N.data[2])){
+        T1 = Vector(-N.data[2], 0, N.data[0]);
+    }
+    else{
+        T1 = Vector(-N.data[1], N.data[0], 0);
+    }
+    T1.normalize();
+    T2 = cross(N, T1);
+    T2.normalize();
+}
+
 void gamma_correction(Vector& color, double correction = 1/2.2){
     color[0] = std::min((double)255, std::max((double)0, pow(color[0], correction)));
     color[1] = std::min((double)255, std::max((double)0, pow(color[1], correction)));
@@ -95,10 +145,21 @@ class Ray {
 public:
     Vector origin;
     Vector unit;
-    explicit Ray(Vector o, Vector u){
+    // Ray cone used to pick texture mip levels: width at the origin and spread angle
+    double cone_width;
+    double cone_spread;
+    explicit Ray(Vector o, Vector u, double width = 0, double spread = 0){
         origin = o;
         unit = u;
         unit.normalize();
+        cone_width = width;
+        cone_spread = spread;
+    }
+    double footprint(double t) const {return cone_width + cone_spread*t;}
+    double diffuse_spread() const {
+        // Spread of a diffuse bounce from this ray: one direction stands for light from the whole hemisphere, so the cone
+        // is widened (0.5 rad at least) and the textures it hits are filtered rather than sampled at the primary ray's mip
+        return std::max(cone_spread, 0.5);
     }
 };
 
@@ -127,8 +188,10 @@ struct Cast{
     bool mirror;
     bool transp;
     double refraction;
-    // If necessary, add pointer to geometry
-    Cast( Intersection inter, Vector alb, double refr) : intersect(inter), albedo(alb), refraction(refr) {
+    Vector emission = Vector(0,0,0);
+    int object = -1;    // id of the hit object in the scene
+    Vector geometric_normal;    // of the surface itself, the shading normal can be interpolated; area light pdfs use it
+    Cast( Intersection inter, Vector alb, double refr) : intersect(inter), albedo(alb), refraction(refr), geometric_normal(inter.normal) {
         if (refraction == -1){
             mirror = false;
             transp = false;
@@ -144,6 +207,7 @@ struct Cast{
     }
     Cast(){
         intersect = Intersection(false, Vector(0,0,0), std::numeric_limits<double>::max(), false, Vector(0,0,1));
+        geometric_normal = intersect.normal;
         albedo = Vector(0,0,0);
         mirror = false;
         transp = false;
@@ -151,11 +215,25 @@ struct Cast{
     }
 };
 
+struct Hit{
+    // Compact record kept during traversal, the full Cast is only built for the closest hit
+    bool flag;
+    double t;
+    int object;     // index in the scene
+    int primitive;  // triangle index for meshes, -1 otherwise
+    double beta, gamma; // barycentric coordinates on the primitive
+    Hit(bool f = false, double ti = std::numeric_limits<double>::max(), int prim = -1, double b = 0, double g = 0) : flag(f), t(ti), object(-1), primitive(prim), beta(b), gamma(g) {}
+};
+
 class Procedural{
 public:
     virtual ~Procedural() {}
     virtual void initialize(std::mt19937* generator) = 0;
     virtual Vector texture(Vector pos) = 0;
+    // Evaluates n positions at once, procedurals that can vectorize override this
+    virtual void texture_batch(const Vector* positions, Vector* out, size_t n){
+        for (size_t i=0; i<n; ++i){out[i] = texture(positions[i]);}
+    }
 };
 
 class Perlin : public Procedural {
@@ -163,21 +241,27 @@ public:
     int dimensions[3];      // "size" of the perlin texture
     int subdivisions[3];    // number of "cuts" per dimension
     Vector cube_dim;
-    std::vector<std::vector<std::vector<Vector>>> perlin_random;
+    // Gradient lattice of (subdivisions+2)^3 vertices, flattened as three planes gx | gy | gz
+    std::vector<double> gradients;
+    size_t lattice_size;
+    int stride[3];          // flat index of vertex (i, j, k) is i*stride[0] + j*stride[1] + k
+    double inv_dimensions[3];
+    double inv_cube_dim[3];
     ~Perlin() override {}
 
     void initialize(std::mt19937* generator) override {
         // We need 2 + subdivisions vertices per dimension
         std::normal_distribution<double> ndis(0.0, 1.0);
-        perlin_random.resize(subdivisions[0]+2);
+        gradients.resize(3*lattice_size);
         for (int i=0; i<subdivisions[0]+2; ++i){
-            perlin_random[i].resize(subdivisions[1]+2);
             for (int j=0; j<subdivisions[1]+2; ++j){
-                perlin_random[i][j].resize(subdivisions[2]+2);
                 for (int k=0; k<subdivisions[2]+2; ++k){
                     Vector random = Vector(ndis(*generator), ndis(*generator), ndis(*generator));
                     random.normalize();
-                    perlin_random[i][j][k] = random;
+                    size_t index = i*stride[0] + j*stride[1] + k;
+                    gradients[index] = random[0];
+                    gradients[lattice_size + index] = random[1];
+                    gradients[2*lattice_size + index] = random[2];
                 }
             }
         }
@@ -189,41 +273,229 @@ public:
             subdivisions[i] = (int)subsv[i];
         }
         cube_dim = Vector((double)dimensions[0]/(subdivisions[0]+1), (double)dimensions[1]/(subdivisions[1]+1), (double)dimensions[2]/(subdivisions[2]+1));
+        stride[2] = 1;
+        stride[1] = subdivisions[2]+2;
+        stride[0] = (subdivisions[1]+2)*stride[1];
+        lattice_size = (size_t)(subdivisions[0]+2)*stride[0];
+        for (int i=0; i<3; ++i){
+            inv_dimensions[i] = 1.0/dimensions[i];
+            inv_cube_dim[i] = 1.0/cube_dim[i];
+        }
     }
 
-    double interpolate(double a0, double a1, double w){
-        return (a1 - a0) * (3.0 - w * 2.0) * w * w + a0;
+    static double smooth(double w){
+        return (3.0 - w * 2.0) * w * w;
     }
 
     Vector texture(Vector position) override {
-
-        Vector pos = Vector(0,0,0);
+        int index[3];   // of "lower" vertex of cube
+        double weights[3];
         for (int i=0; i<3; ++i){
-            pos[i] = fmod(position[i], dimensions[i]); // Value between 0 and dimensions (should be excluded)
-            if (pos[i] < 0){pos[i] += dimensions[i];}
+            double pos = position[i] - dimensions[i]*std::floor(position[i]*inv_dimensions[i]); // Value between 0 and dimensions
+            double cell = std::min(std::floor(pos*inv_cube_dim[i]), (double)subdivisions[i]);
+            index[i] = (int)cell;
+            weights[i] = pos*inv_cube_dim[i] - cell;
+        }
+        const double *gx = gradients.data();
+        const double *gy = gx + lattice_size;
+        const double *gz = gy + lattice_size;
+        size_t base = index[0]*stride[0] + index[1]*stride[1] + index[2];
+
+        // 000 ; 100 ; 010 ; 110 ; 001 ; 101 ; 011 ; 111
+        double dots[8];
+        for (int i=0; i<8; ++i){
+            int i0 = i&1, i1 = (i>>1)&1, i2 = (i>>2)&1;
+            size_t corner = base + i0*stride[0] + i1*stride[1] + i2;
+            dots[i] = (i0 - weights[0])*cube_dim[0]*gx[corner] + (i1 - weights[1])*cube_dim[1]*gy[corner] + (i2 - weights[2])*cube_dim[2]*gz[corner];
         }
+        double sx = smooth(weights[0]), sy = smooth(weights[1]), sz = smooth(weights[2]);
+        double xinterp[4];
+        for (int i=0; i<4; ++i){xinterp[i] = dots[2*i] + (dots[2*i+1] - dots[2*i])*sx;}
+        double yinterp[2] {xinterp[0] + (xinterp[1] - xinterp[0])*sy, xinterp[2] + (xinterp[3] - xinterp[2])*sy};
+        double zinterp = yinterp[0] + (yinterp[1] - yinterp[0])*sz;
+
+        return uvec(255 * (zinterp+1.0)/2.0);
+    }
 
-        int index[3] {(int)std::floor(pos[0]/cube_dim[0]), (int)std::floor(pos[1]/cube_dim[1]), (int)std::floor(pos[2]/cube_dim[2])}; // of "lower" position of cube
-        Vector lower_cube = Vector(index[0]*cube_dim[0], index[1]*cube_dim[1], index[2]*cube_dim[2]);
+    void texture_batch(const Vector* positions, Vector* out, size_t n) override {
+        size_t i = 0;
+#if defined (__AVX2__) && defined (__FMA__)
+        // 4 positions per iteration, the 8 corner gradients are gathered from the flat lattice
+        const double *gx = gradients.data();
+        const double *gy = gx + lattice_size;
+        const double *gz = gy + lattice_size;
+        for (; i+4 <= n; i+=4){
+            __m256d offset[3], smoothw[3];
+            __m256i base = _mm256_setzero_si256();
+            for (int a=0; a<3; ++a){
+                __m256d p = _mm256_set_pd(positions[i+3][a], positions[i+2][a], positions[i+1][a], positions[i][a]);
+                __m256d dim = _mm256_set1_pd(dimensions[a]);
+                p = _mm256_sub_pd(p, _mm256_mul_pd(dim, _mm256_floor_pd(_mm256_mul_pd(p, _mm256_set1_pd(inv_dimensions[a])))));
+                __m256d scaled = _mm256_mul_pd(p, _mm256_set1_pd(inv_cube_dim[a]));
+                __m256d cell = _mm256_min_pd(_mm256_floor_pd(scaled), _mm256_set1_pd(subdivisions[a]));
+                __m256d w = _mm256_sub_pd(scaled, cell);
+                offset[a] = w;
+                smoothw[a] = _mm256_mul_pd(_mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(3.0), _mm256_add_pd(w, w)), w), w);
+                __m256i cell_i = _mm256_cvtepi32_epi64(_mm256_cvtpd_epi32(cell));
+                base = _mm256_add_epi64(base, _mm256_mul_epi32(cell_i, _mm256_set1_epi64x(stride[a])));
+            }
+            __m256d dots[8];
+            for (int c=0; c<8; ++c){
+                int i0 = c&1, i1 = (c>>1)&1, i2 = (c>>2)&1;
+                __m256i corner = _mm256_add_epi64(base, _mm256_set1_epi64x(i0*stride[0] + i1*stride[1] + i2));
+                __m256d ox = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(i0), offset[0]), _mm256_set1_pd(cube_dim[0]));
+                __m256d oy = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(i1), offset[1]), _mm256_set1_pd(cube_dim[1]));
+                __m256d oz = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(i2), offset[2]), _mm256_set1_pd(cube_dim[2]));
+                __m256d d = _mm256_mul_pd(ox, _mm256_i64gather_pd(gx, corner, 8));
+                d = _mm256_fmadd_pd(oy, _mm256_i64gather_pd(gy, corner, 8), d);
+                dots[c] = _mm256_fmadd_pd(oz, _mm256_i64gather_pd(gz, corner, 8), d);
+            }
+            __m256d xinterp[4];
+            for (int c=0; c<4; ++c){xinterp[c] = _mm256_fmadd_pd(_mm256_sub_pd(dots[2*c+1], dots[2*c]), smoothw[0], dots[2*c]);}
+            __m256d y0 = _mm256_fmadd_pd(_mm256_sub_pd(xinterp[1], xinterp[0]), smoothw[1], xinterp[0]);
+            __m256d y1 = _mm256_fmadd_pd(_mm256_sub_pd(xinterp[3], xinterp[2]), smoothw[1], xinterp[2]);
+            __m256d z = _mm256_fmadd_pd(_mm256_sub_pd(y1, y0), smoothw[2], y0);
+            z = _mm256_mul_pd(_mm256_add_pd(z, _mm256_set1_pd(1.0)), _mm256_set1_pd(255/2.0));
+            double values[4];
+            _mm256_storeu_pd(values, z);
+            for (int k=0; k<4; ++k){out[i+k] = uvec(values[k]);}
+        }
+#endif
+        for (; i<n; ++i){out[i] = texture(positions[i]);}
+    }
+};
 
-        Vector offset[8];
-        bool i0, i1, i2;
+void perlin_benchmark(size_t samples = 1 << 21){
+    // Compares the flat lattice (scalar and batched) with the previous nested-vector implementation
+    std::mt19937 generator(42);
+    Perlin perlin = Perlin(Vector(100,100,100), Vector(100,130,130));
+    perlin.initialize(&generator);
+
+    std::vector<std::vector<std::vector<Vector>>> nested(perlin.subdivisions[0]+2, std::vector<std::vector<Vector>>(perlin.subdivisions[1]+2, std::vector<Vector>(perlin.subdivisions[2]+2)));
+    for (size_t i=0; i<nested.size(); ++i){
+        for (size_t j=0; j<nested[i].size(); ++j){
+            for (size_t k=0; k<nested[i][j].size(); ++k){
+                size_t index = i*perlin.stride[0] + j*perlin.stride[1] + k;
+                nested[i][j][k] = Vector(perlin.gradients[index], perlin.gradients[perlin.lattice_size + index], perlin.gradients[2*perlin.lattice_size + index]);
+            }
+        }
+    }
+    auto interpolate = [](double a0, double a1, double w){return (a1 - a0) * (3.0 - w * 2.0) * w * w + a0;};
+    auto nested_texture = [&](Vector position){
+        Vector pos = Vector(0,0,0);
+        for (int i=0; i<3; ++i){
+            pos[i] = fmod(position[i], perlin.dimensions[i]);
+            if (pos[i] < 0){pos[i] += perlin.dimensions[i];}
+        }
+        int index[3] {(int)std::floor(pos[0]/perlin.cube_dim[0]), (int)std::floor(pos[1]/perlin.cube_dim[1]), (int)std::floor(pos[2]/perlin.cube_dim[2])};
+        Vector lower_cube = Vector(index[0]*perlin.cube_dim[0], index[1]*perlin.cube_dim[1], index[2]*perlin.cube_dim[2]);
         double dots[8];
         for (int i=0; i<8; ++i){
-            i0 = i%2;
-            i1 = (i/2)%2;
-            i2 = (i/4)%2;
-            offset[i] = lower_cube + Vector(i0*cube_dim[0], i1*cube_dim[1], i2*cube_dim[2]) - pos;
-            dots[i] = dot(offset[i], perlin_random[index[0]+i0][index[1]+i1][index[2]+i2]);
+            bool i0 = i%2, i1 = (i/2)%2, i2 = (i/4)%2;
+            Vector offset = lower_cube + Vector(i0*perlin.cube_dim[0], i1*perlin.cube_dim[1], i2*perlin.cube_dim[2]) - pos;
+            dots[i] = dot(offset, nested[index[0]+i0][index[1]+i1][index[2]+i2]);
         }
-        // 000 ; 100 ; 010 ; 110 ; 001 ; 101 ; 011 ; 111
         Vector weights = (pos-lower_cube);
-        for (int i=0; i<3; ++i){weights[i] = weights[i]/cube_dim[i];}
+        for (int i=0; i<3; ++i){weights[i] = weights[i]/perlin.cube_dim[i];}
         double xinterp[4] {interpolate(dots[0], dots[1], weights[0]), interpolate(dots[2], dots[3], weights[0]), interpolate(dots[4], dots[5], weights[0]), interpolate(dots[6], dots[7], weights[0])};
         double yinterp[2] {interpolate(xinterp[0], xinterp[1], weights[1]), interpolate(xinterp[2], xinterp[3], weights[1])};
-        double zinterp = interpolate(yinterp[0], yinterp[1], weights[2]);
+        return uvec(255 * (interpolate(yinterp[0], yinterp[1], weights[2])+1.0)/2.0);
+    };
+
+    // Positions on a small object like the scene spheres, so the lattice mostly stays in cache
+    std::uniform_real_distribution<double> udis(-4, 4);
+    std::vector<Vector> positions(samples);
+    for (size_t i=0; i<samples; ++i){positions[i] = Vector(udis(generator), udis(generator), udis(generator));}
+    std::vector<Vector> reference(samples), scalar(samples), batched(samples);
+
+    std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
+    for (size_t i=0; i<samples; ++i){reference[i] = nested_texture(positions[i]);}
+    double nested_time = (std::chrono::steady_clock::now() - start).count()/(double)pow(10, 9);
+    start = std::chrono::steady_clock::now();
+    for (size_t i=0; i<samples; ++i){scalar[i] = perlin.texture(positions[i]);}
+    double scalar_time = (std::chrono::steady_clock::now() - start).count()/(double)pow(10, 9);
+    start = std::chrono::steady_clock::now();
+    perlin.texture_batch(positions.data(), batched.data(), samples);
+    double batched_time = (std::chrono::steady_clock::now() - start).count()/(double)pow(10, 9);
 
-        return uvec(255 * (zinterp+1.0)/2.0);
+    double max_diff = 0;
+    for (size_t i=0; i<samples; ++i){
+        max_diff = std::max(max_diff, std::max(std::abs(reference[i][0] - scalar[i][0]), std::abs(reference[i][0] - batched[i][0])));
+    }
+    std::cout << "Perlin benchmark on " << samples << " positions" << std::endl;
+    std::cout << "Nested vectors: " << nested_time << "s" << std::endl;
+    std::cout << "Flat lattice:   " << scalar_time << "s (x" << nested_time/scalar_time << ")" << std::endl;
+    std::cout << "Flat batched:   " << batched_time << "s (x" << nested_time/batched_time << ")" << std::endl;
+    std::cout << "Max difference with nested vectors: " << max_diff << std::endl;
+}
+
+class BakedProcedural : public Procedural {
+public:
+    // Procedural sampled once on a voxel grid over a box, then trilinearly interpolated
+    Vector pmin;
+    Vector cell;            // size of a voxel
+    int samples[3];         // number of grid points per dimension
+    std::vector<float> values; // RGB per grid point, x varies fastest
+    ~BakedProcedural() override {}
+
+    // The source must already be initialized, it is only used during the bake
+    explicit BakedProcedural(Procedural* source, Vector box_min, Vector box_max, int resolution, size_t n_threads = std::max(1u, std::thread::hardware_concurrency())){
+        pmin = box_min;
+        Vector extent = box_max - box_min;
+        double max_extent = std::max(std::max(extent[0], extent[1]), extent[2]);
+        for (int i=0; i<3; ++i){
+            samples[i] = std::max(2, (int)std::ceil(resolution * extent[i]/max_extent) + 1);
+            cell[i] = std::max(extent[i], 1e-9)/(samples[i]-1);
+        }
+        values.resize((size_t)3*samples[0]*samples[1]*samples[2]);
+
+        // Slices along z are shared between the threads, each row of x goes through texture_batch
+        std::vector<std::thread> threads;
+        for (size_t thread = 0; thread < n_threads; ++thread){
+            threads.push_back(std::thread([this, source, thread, n_threads](){
+                std::vector<Vector> positions(samples[0]);
+                std::vector<Vector> colors(samples[0]);
+                for (int k = thread; k < samples[2]; k += n_threads){
+                    for (int j = 0; j < samples[1]; ++j){
+                        for (int i = 0; i < samples[0]; ++i){
+                            positions[i] = pmin + Vector(i*cell[0], j*cell[1], k*cell[2]);
+                        }
+                        source->texture_batch(positions.data(), colors.data(), samples[0]);
+                        float *row = &values[3*grid_index(0, j, k)];
+                        for (int i = 0; i < samples[0]; ++i){
+                            for (int c=0; c<3; ++c){row[3*i+c] = colors[i][c];}
+                        }
+                    }
+                }
+            }));
+        }
+        for (size_t thread = 0; thread < threads.size(); ++thread){
+            threads[thread].join();
+        }
+    }
+
+    void initialize(std::mt19937* generator) override {(void)generator;}
+
+    size_t grid_index(int i, int j, int k) const {
+        return ((size_t)k*samples[1] + j)*samples[0] + i;
+    }
+
+    Vector texture(Vector position) override {
+        int index[3];
+        double weights[3];
+        for (int a=0; a<3; ++a){
+            double p = std::min((double)samples[a]-1, std::max((double)0, (position[a] - pmin[a])/cell[a]));
+            index[a] = std::min((int)p, samples[a]-2);
+            weights[a] = p - index[a];
+        }
+        Vector color = Vector(0,0,0);
+        for (int c=0; c<8; ++c){
+            int i0 = c&1, i1 = (c>>1)&1, i2 = (c>>2)&1;
+            double weight = (i0 ? weights[0] : 1-weights[0]) * (i1 ? weights[1] : 1-weights[1]) * (i2 ? weights[2] : 1-weights[2]);
+            const float *value = &values[3*grid_index(index[0]+i0, index[1]+i1, index[2]+i2)];
+            color = color + weight*Vector(value[0], value[1], value[2]);
+        }
+        return color;
     }
 };
 
@@ -234,21 +506,75 @@ class Geometry{
         Vector (*movement)(double);
         double refraction;
         Procedural* procedural;
-        virtual Cast intersect_r(Ray &r, double time) = 0;
-        Cast intersect(Ray &r, double time){
-            Cast inter = intersect_r(r, time);
+        Vector emission = Vector(0,0,0);   // radiance emitted by the surface, on both sides; objects with an emission are area lights
+        bool moving = true;     // cleared by Scene::prepare when movement is constant_position
+        Vector position(double time){
+            return moving ? origin + movement(time) : origin;
+        }
+        // Static objects fold origin into their own data once, origin is then (0,0,0)
+        virtual void bake_origin() {}
+        virtual Hit intersect_r(Ray &r, double time) = 0;
+        // Any-hit query: true if something is hit at a distance in ]0, tmax[, no shading is done
+        virtual bool occluded(Ray &r, double tmax, double time) = 0;
+        // Builds the full Cast (position, normal, albedo) of a hit returned by intersect_r
+        virtual Cast shade_r(Ray &r, const Hit &hit, double time) = 0;
+        // Bounds relative to position(time)
+        virtual void local_bounds(Vector &pmin, Vector &pmax) = 0;
+        // Area light sampling, only for objects able to emit: surface area, a point (and its normal) seen from `from` with
+        // its solid angle pdf, 0 when no point can be sampled, and the pdf sample_emitter would give to a point
+        // The point is a function of the two uniforms u1, u2 so that samplers can stratify them
+        virtual double area() {return 0;}
+        virtual double sample_emitter(const Vector& from, double time, double u1, double u2, Vector& point, Vector& normal){
+            (void)from; (void)time; (void)u1; (void)u2; (void)point; (void)normal;
+            return 0;
+        }
+        virtual double emitter_pdf(const Vector& from, const Vector& point, const Vector& normal, double time){
+            (void)from; (void)point; (void)normal; (void)time;
+            return 0;
+        }
+        void world_bounds(Vector &pmin, Vector &pmax, int time_samples = 64){
+            // Union over the shutter time of the local bounds, moved with the object
+            Vector lmin, lmax;
+            local_bounds(lmin, lmax);
+            pmin = uvec(std::numeric_limits<double>::max());
+            pmax = uvec(std::numeric_limits<double>::lowest());
+            for (int i=0; i<=time_samples; ++i){
+                Vector moved = position((double)i/time_samples);
+                min_vec(pmin, lmin + moved);
+                max_vec(pmax, lmax + moved);
+            }
+        }
+        Cast shade(Ray &r, const Hit &hit, double time){
+            Cast inter = shade_r(r, hit, time);
             if (procedural != nullptr && inter.intersect.flag == true){
                 inter.mirror = false;
                 inter.transp = false;
                 inter.refraction = -1;
                 inter.albedo = procedural->texture(inter.intersect.position);
             }
+            inter.emission = emission;
             return inter;
         }
 };
 
 Vector constant_position(double t){(void)t; return Vector(0,0,0);}
 
+template <class T>
+T emissive(T object, const Vector& emission){
+    // Turns an object into an area light
+    // Only objects with an area() are sampled as lights, an emissive SphereSet or Plane shows its emission to the rays hitting it but is never light sampled
+    object.emission = emission;
+    return object;
+}
+
+double area_to_solid_angle(const Vector& from, const Vector& point, const Vector& normal){
+    // Converts a pdf per unit area at point into a pdf per solid angle seen from from
+    Vector to_point = point - from;
+    double d2 = to_point.norm2();
+    double cos_light = abs(dot(normal, to_point))/sqrt(d2);
+    return (cos_light > 0) ? d2/cos_light : 0;
+}
+
 Vector ninja_movement_yellow(double t){
     // Diameter is 6 so movement ~5
     if (t<0.075){return Vector(-5, 0, 0);}
@@ -263,30 +589,28 @@ Vector throw_movement(double t){
     return Vector(8*tp,25*tp - 20*pow(tp, 2),0);
 }
 
-struct IntersectParam{
-    Intersection intersect;
-    Vector param;
-    IntersectParam(Intersection i, Vector p) : intersect(i), param(p) {}
-};
-
-IntersectParam triangle_intersect(const Vector& A, const Vector& B, const Vector& C, Ray &r, const Vector& normalA, const Vector& normalB, const Vector& normalC){
+Hit triangle_intersect(const Vector& A, const Vector& B, const Vector& C, Ray &r){
     Vector e1 = B-A;
     Vector e2 = C-A;
     Vector N = cross(e1, e2);
     double dotUN = dot(r.unit, N);
     if (dotUN == 0){
-        return IntersectParam(Intersection(false, Vector(0,0,0), 0, false, N), Vector(-1,-1,-1));
+        return Hit();
     }
-    double beta = dot(e2, cross(A - r.origin, r.unit))/dotUN;
-    double gamma = -dot(e1, cross(A - r.origin, r.unit))/dotUN;
+    Vector AOxU = cross(A - r.origin, r.unit);
+    double beta = dot(e2, AOxU)/dotUN;
+    double gamma = -dot(e1, AOxU)/dotUN;
     double alpha = 1 - beta - gamma;
     double t = dot(A - r.origin, N)/dotUN;
     if (0<=alpha && alpha<=1 && 0<=beta && beta<=1 && 0<=gamma && gamma<=1 && t>0){
-        Vector shading_normal = alpha * normalA + beta * normalB + gamma * normalC;
-        shading_normal.normalize();
-        return IntersectParam(Intersection(true, A + beta*e1 + gamma*e2, t, false, shading_normal), Vector(alpha, beta, gamma));
+        return Hit(true, t, -1, beta, gamma);
     }
-    return IntersectParam(Intersection(false, Vector(0,0,0), 0, false, Vector(0,0,1)), Vector(-1,-1,-1));
+    return Hit();
+}
+
+bool triangle_occluded(const Vector& A, const Vector& B, const Vector& C, Ray &r, double tmax){
+    Hit hit = triangle_intersect(A, B, C, r);
+    return (hit.flag && hit.t < tmax);
 }
 
 struct PlaneIntersection{
@@ -297,18 +621,6 @@ struct PlaneIntersection{
 
 enum class Axis {x=0, y=1, z=2};
 
-void min_vec(Vector &to_min, Vector b){
-    for (int i=0; i<3; ++i){
-        to_min[i] = std::min(to_min[i], b[i]);
-    }
-}
-
-void max_vec(Vector &to_max, Vector b){
-    for (int i=0; i<3; ++i){
-        to_max[i] = std::max(to_max[i], b[i]);
-    }
-}
-
 double surface(Vector dim){
     return 2 * ((dim[0] * dim[1]) + (dim[1] * dim[2]) + (dim[2] * dim[0]));
 }
@@ -318,14 +630,18 @@ public:
     Vector pmin, pmax;
     size_t indexmin, indexmax;
     bool is_leaf;
-    BoundingBox* left_child;
-    BoundingBox* right_child;
+    std::unique_ptr<BoundingBox> left_child;
+    std::unique_ptr<BoundingBox> right_child;
 
-    BoundingBox(Vector min = uvec(std::numeric_limits<double>::max()), Vector max = uvec(std::numeric_limits<double>::lowest()), size_t imin = 0, size_t imax = 0, bool leaf = true, BoundingBox* lc = nullptr, BoundingBox* rc = nullptr) : pmin(min), pmax(max), indexmin(imin), indexmax(imax), is_leaf(leaf), left_child(lc), right_child(rc) {}
+    BoundingBox(Vector min = uvec(std::numeric_limits<double>::max()), Vector max = uvec(std::numeric_limits<double>::lowest()), size_t imin = 0, size_t imax = 0, bool leaf = true) : pmin(min), pmax(max), indexmin(imin), indexmax(imax), is_leaf(leaf) {}
 
-    ~BoundingBox(){
-        delete left_child;
-        delete right_child;
+    void translate(const Vector& offset){
+        pmin = pmin + offset;
+        pmax = pmax + offset;
+        if (!is_leaf){
+            left_child->translate(offset);
+            right_child->translate(offset);
+        }
     }
 
     PlaneIntersection intersect_plane(Ray &r, const Vector& A, const Vector& Normal){
@@ -339,6 +655,16 @@ public:
 
     double intersect_box(Ray &r, const Vector& origin){
         // Returns absolute distance to box or -1 if not intersected
+        double entry, leave;
+        if (box_interval(r, origin, entry, leave)){
+            return std::min(abs(leave), abs(entry));
+        }
+        return -1;
+    }
+
+    bool box_interval(Ray &r, const Vector& origin, double &entry, double &leave){
+        // Distances along the ray where it enters and leaves the box, entry is negative if the ray starts inside
+        // Returns false if the ray misses the box
         PlaneIntersection pxmin = intersect_plane(r, Vector(pmin[0], 0, 0) + origin, Vector(1, 0, 0));
         PlaneIntersection pxmax = intersect_plane(r, Vector(pmax[0], 0, 0) + origin, Vector(1, 0, 0));
         if (pxmin.flag == false){ // same as pxmax.flag==false
@@ -384,13 +710,14 @@ public:
         
         double mint1 = std::min(std::min(t1x, t1y), t1z);
         double maxt0 = std::max(std::max(t0x, t0y), t0z);
-        if (mint1 > maxt0 && mint1 >= 0){ // if mint1 < 0 the bounding box is fully behind the ray
-            return std::min(abs(mint1), abs(maxt0));
-        }
-        return -1;
+        entry = maxt0;
+        leave = mint1;
+        return mint1 > maxt0 && mint1 >= 0; // if mint1 < 0 the bounding box is fully behind the ray
     }
 
-    void split_box(std::vector<TriangleIndices> &indices, std::vector<Vector> &vertices){
+    // bounds(primitive, pmin, pmax, centroid) gives the box and the split position of a primitive
+    template <class Primitive, class Bounds>
+    void split_box(std::vector<Primitive> &primitives, Bounds bounds){
         if (is_leaf == false){throw "Bounding box with children can't be split";}
         is_leaf = false;
         
@@ -412,17 +739,17 @@ public:
             }
             double da = (pmax - pmin)[(int)axis];
             double pa = pmin[(int)axis];
+            if (da <= 0){continue;} // flat along this axis, nothing to split
             // We put each primitive into a bucket
+            Vector prim_min, prim_max, baryc;
             for (size_t i = indexmin; i < indexmax; ++i){
-                Vector baryc = (vertices[indices[i].vtxi]+vertices[indices[i].vtxj]+vertices[indices[i].vtxk])/3;
+                bounds(primitives[i], prim_min, prim_max, baryc);
                 int group = std::floor((baryc[(int)axis] - pa)*(double)nbucks/da);
-                if (group == nbucks) {group = nbucks-1;}
+                group = std::min(nbucks-1, std::max(0, group));
                 ++bucket_count[group];
                 // We update the bucket
-                for (Vector vertex : {vertices[indices[i].vtxi], vertices[indices[i].vtxj], vertices[indices[i].vtxk]}){
-                    min_vec(buckets[group][0], vertex);
-                    max_vec(buckets[group][1], vertex);
-                }
+                min_vec(buckets[group][0], prim_min);
+                max_vec(buckets[group][1], prim_max);
             }
         
             // We compute the cost now
@@ -473,29 +800,24 @@ public:
 
         // Quicksort indices in [indexmin, indexmax] according to bounding box and remember splitting index
         size_t pivot = indexmin;
+        Vector prim_min, prim_max, baryc;
         for (size_t i = indexmin; i < indexmax; ++i){
-            Vector baryc = (vertices[indices[i].vtxi]+vertices[indices[i].vtxj]+vertices[indices[i].vtxk])/3;
+            bounds(primitives[i], prim_min, prim_max, baryc);
             if (baryc[(int)best_axis] < best_position){
-                std::swap(indices[i], indices[pivot]);
+                std::swap(primitives[i], primitives[pivot]);
                 ++pivot;
             }
         }
 
         // Make the two children bounding boxes according to the split
-        left_child = new BoundingBox();
-        right_child = new BoundingBox();
+        left_child = std::make_unique<BoundingBox>();
+        right_child = std::make_unique<BoundingBox>();
 
-        for (size_t i = indexmin; i < pivot; ++i){
-            for (Vector vertex : {vertices[indices[i].vtxi], vertices[indices[i].vtxj], vertices[indices[i].vtxk]}){
-                min_vec(left_child->pmin, vertex);
-                max_vec(left_child->pmax, vertex);
-            }
-        }
-        for (size_t i = pivot; i < indexmax; ++i){
-            for (Vector vertex : {vertices[indices[i].vtxi], vertices[indices[i].vtxj], vertices[indices[i].vtxk]}){
-                min_vec(right_child->pmin, vertex);
-                max_vec(right_child->pmax, vertex);
-            }
+        for (size_t i = indexmin; i < indexmax; ++i){
+            BoundingBox* child = (i < pivot) ? left_child.get() : right_child.get();
+            bounds(primitives[i], prim_min, prim_max, baryc);
+            min_vec(child->pmin, prim_min);
+            max_vec(child->pmax, prim_max);
         }
 
         left_child->indexmin = indexmin;
@@ -504,31 +826,312 @@ public:
         right_child->indexmax = indexmax;
     }
 
-    void split_boxes(std::vector<TriangleIndices> &indices, std::vector<Vector> &vertices, size_t max_meshes = 4){
+    template <class Primitive, class Bounds>
+    void split_boxes(std::vector<Primitive> &primitives, Bounds bounds, size_t max_meshes = 4){
         if (indexmax - indexmin > max_meshes){
-            split_box(indices, vertices);
+            split_box(primitives, bounds);
             if (left_child->indexmax == indexmax || right_child->indexmin == indexmin){
                 is_leaf = true;
-                left_child = nullptr;
-                right_child = nullptr;
+                left_child.reset();
+                right_child.reset();
             } else {
-                left_child->split_boxes(indices, vertices, max_meshes);
-                right_child->split_boxes(indices, vertices, max_meshes);
+                left_child->split_boxes(primitives, bounds, max_meshes);
+                right_child->split_boxes(primitives, bounds, max_meshes);
             }
         }
         
     }
 };
 
-class TriangleMesh : public Geometry {
+bool replace_file(const std::string& tmp_path, const std::string& path){
+    // Moves a completely written tmp_path over path, readers see either the old or the new file
+    if (rename(tmp_path.c_str(), path.c_str()) != 0){
+        remove(path.c_str()); // Windows doesn't rename over an existing file
+        if (rename(tmp_path.c_str(), path.c_str()) != 0){
+            remove(tmp_path.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+bool write_png(const std::string& path, int W, int H, int channels, const unsigned char* data){
+    std::string tmp_path = path + ".tmp";
+    if (stbi_write_png(tmp_path.c_str(), W, H, channels, data, 0) == 0){
+        remove(tmp_path.c_str());
+        return false;
+    }
+    return replace_file(tmp_path, path);
+}
+
+class MappedFile {
+public:
+    // Read-only memory mapping of a whole file, size is 0 if the mapping failed
+    const unsigned char *data = nullptr;
+    size_t size = 0;
+
+    explicit MappedFile(const std::string& path){
+#if defined (_WIN32)
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE){return;}
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0){return;}
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping == nullptr){return;}
+        data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (data != nullptr){size = file_size.QuadPart;}
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0){return;}
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0){
+            void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED){
+                data = (const unsigned char*)map;
+                size = st.st_size;
+            }
+        }
+        close(fd);
+#endif
+    }
+
+    ~MappedFile(){
+#if defined (_WIN32)
+        if (data != nullptr){UnmapViewOfFile(data);}
+        if (mapping != nullptr){CloseHandle(mapping);}
+        if (file != INVALID_HANDLE_VALUE){CloseHandle(file);}
+#else
+        if (data != nullptr){munmap((void*)data, size);}
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+private:
+#if defined (_WIN32)
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+};
+
+uint64_t hash_file(const char* path){
+    // FNV-1a over 8 byte words, the tail is padded with zeros. Returns 0 if the file can't be read
+    FILE* f = fopen(path, "rb");
+    if (f == nullptr){return 0;}
+    uint64_t hash = 14695981039346656037ULL;
+    std::vector<uint64_t> buffer(1 << 16);
+    size_t read;
+    while ((read = fread(buffer.data(), 1, buffer.size()*sizeof(uint64_t), f)) > 0){
+        size_t words = (read + sizeof(uint64_t) - 1)/sizeof(uint64_t);
+        if (read % sizeof(uint64_t) != 0){
+            memset((unsigned char*)buffer.data() + read, 0, words*sizeof(uint64_t) - read);
+        }
+        for (size_t i=0; i<words; ++i){
+            hash = (hash ^ buffer[i]) * 1099511628211ULL;
+        }
+        hash = (hash ^ read) * 1099511628211ULL;
+    }
+    fclose(f);
+    return hash;
+}
+
+uint64_t hash_string(const std::string& text){
+    // FNV-1a over the bytes
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : text){
+        hash = (hash ^ c) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+class Texture {
 public:
-    ~TriangleMesh() {
-        stbi_image_free(uv);
+    // Linear RGB texels (between 0 and 1) with their full mip pyramid, each level stored by tiles of TILE*TILE texels
+    static const int TILE = 8;
+    struct Level{
+        int width, height, tiles_x;
+        size_t offset; // in texels, from the start of texels
+    };
+    std::vector<Level> levels;
+    std::vector<float> texels;
+    std::shared_ptr<MappedFile> cache; // when loaded from the disk cache the texels live in the mapping instead
+
+    // Cache file layout: CacheHeader, the levels, then the texels of all levels
+    static constexpr char CACHE_MAGIC[8] = {'R', 'T', 'T', 'E', 'X', '0', '0', '1'};
+    struct CacheHeader{
+        char magic[8];
+        uint64_t source_hash;
+        uint64_t nlevels;
+        uint64_t ntexels;
+    };
+
+    Texture() {}
+
+    explicit Texture(const char* file, bool use_cache = true){
+        if (use_cache){
+            uint64_t source_hash = hash_file(file);
+            char hash_string[17];
+            snprintf(hash_string, sizeof(hash_string), "%016llx", (unsigned long long)source_hash);
+            std::string cache_path = std::string(file) + "." + hash_string + ".texcache";
+            if (source_hash != 0 && load_cache(cache_path, source_hash)){
+                return;
+            }
+            decode(file);
+            if (source_hash != 0){
+                write_cache(cache_path, source_hash);
+            }
+        } else {
+            decode(file);
+        }
+    }
+
+    bool load_cache(const std::string& path, uint64_t source_hash){
+        std::shared_ptr<MappedFile> mapped = std::make_shared<MappedFile>(path);
+        if (mapped->size < sizeof(CacheHeader)){return false;}
+        CacheHeader header;
+        memcpy(&header, mapped->data, sizeof(CacheHeader));
+        if (memcmp(header.magic, CACHE_MAGIC, 8) != 0 || header.source_hash != source_hash){return false;}
+        size_t texels_offset = sizeof(CacheHeader) + header.nlevels*sizeof(Level);
+        if (mapped->size != texels_offset + header.ntexels*sizeof(float)){return false;}
+        levels.resize(header.nlevels);
+        memcpy(levels.data(), mapped->data + sizeof(CacheHeader), header.nlevels*sizeof(Level));
+        texels.clear();
+        cache = mapped;
+        return true;
+    }
+
+    void write_cache(const std::string& path, uint64_t source_hash){
+        // Written to a temporary file then renamed so a concurrent run never maps a partial file
+        CacheHeader header;
+        memcpy(header.magic, CACHE_MAGIC, 8);
+        header.source_hash = source_hash;
+        header.nlevels = levels.size();
+        header.ntexels = texels.size();
+        std::string tmp_path = path + ".tmp";
+        FILE* f = fopen(tmp_path.c_str(), "wb");
+        if (f == nullptr){return;}
+        bool ok = fwrite(&header, sizeof(CacheHeader), 1, f) == 1;
+        ok = ok && fwrite(levels.data(), sizeof(Level), levels.size(), f) == levels.size();
+        ok = ok && fwrite(texels.data(), sizeof(float), texels.size(), f) == texels.size();
+        ok = (fclose(f) == 0) && ok;
+        if (!ok){
+            remove(tmp_path.c_str());
+            return;
+        }
+        replace_file(tmp_path, path);
+    }
+
+    const float* texel_data() const {
+        if (cache != nullptr){
+            return (const float*)(cache->data + sizeof(CacheHeader) + levels.size()*sizeof(Level));
+        }
+        return texels.data();
+    }
+
+    void decode(const char* file){
+        int w, h, n;
+        if (stbi_info(file, &w, &h, &n) == 0){
+            throw "Error loading UV file";
+        }
+        unsigned char *raw = stbi_load(file, &w, &h, &n, 3);
+        if (raw == nullptr){
+            throw "Error loading UV file";
+        }
+        // Linearize once here instead of at every hit
+        float to_linear[256];
+        for (int i=0; i<256; ++i){to_linear[i] = pow(i/255.0, 2.2);}
+
+        allocate(w, h);
+        for (int y=0; y<h; ++y){
+            for (int x=0; x<w; ++x){
+                float *texel = &texels[3*index(levels[0], x, y)];
+                for (int c=0; c<3; ++c){texel[c] = to_linear[raw[3*(y*w + x) + c]];}
+            }
+        }
+        stbi_image_free(raw);
+        build_mipmaps();
+    }
+
+    void allocate(int w, int h){
+        levels.clear();
+        size_t total = 0;
+        while (true){
+            Level level {w, h, (w+TILE-1)/TILE, total};
+            levels.push_back(level);
+            total += (size_t)level.tiles_x * ((h+TILE-1)/TILE) * TILE * TILE;
+            if (w == 1 && h == 1){break;}
+            w = std::max(1, w/2);
+            h = std::max(1, h/2);
+        }
+        texels.assign(3*total, 0);
+    }
+
+    void build_mipmaps(){
+        // Box filter of the 2x2 texels above, edges are clamped for odd sizes
+        for (size_t l=1; l<levels.size(); ++l){
+            const Level &up = levels[l-1];
+            const Level &level = levels[l];
+            for (int y=0; y<level.height; ++y){
+                for (int x=0; x<level.width; ++x){
+                    float *texel = &texels[3*index(level, x, y)];
+                    for (int dy=0; dy<2; ++dy){
+                        for (int dx=0; dx<2; ++dx){
+                            const float *src = &texels[3*index(up, std::min(2*x+dx, up.width-1), std::min(2*y+dy, up.height-1))];
+                            for (int c=0; c<3; ++c){texel[c] += src[c]/4;}
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    static size_t index(const Level &level, int x, int y){
+        return level.offset + ((size_t)(y/TILE)*level.tiles_x + x/TILE)*TILE*TILE + (y%TILE)*TILE + (x%TILE);
+    }
+
+    Vector fetch(const Level &level, int x, int y) const {
+        // Repeat addressing
+        x %= level.width;
+        if (x < 0){x += level.width;}
+        y %= level.height;
+        if (y < 0){y += level.height;}
+        const float *texel = texel_data() + 3*index(level, x, y);
+        return Vector(texel[0], texel[1], texel[2]);
+    }
+
+    Vector bilinear(int l, double u, double v) const {
+        const Level &level = levels[l];
+        double px = u*level.width - 0.5;
+        double py = (1-v)*level.height - 0.5;
+        int x0 = std::floor(px);
+        int y0 = std::floor(py);
+        double fx = px - x0;
+        double fy = py - y0;
+        return (1-fy) * ((1-fx)*fetch(level, x0, y0) + fx*fetch(level, x0+1, y0)) + fy * ((1-fx)*fetch(level, x0, y0+1) + fx*fetch(level, x0+1, y0+1));
+    }
+
+    Vector sample(double u, double v, double lod) const {
+        // Trilinear filtering between the two closest mip levels
+        lod = std::min((double)levels.size()-1, std::max((double)0, lod));
+        int l0 = std::floor(lod);
+        double f = lod - l0;
+        if (f == 0){
+            return bilinear(l0, u, v);
+        }
+        return (1-f)*bilinear(l0, u, v) + f*bilinear(l0+1, u, v);
     }
 
+    int width() const {return levels[0].width;}
+    int height() const {return levels[0].height;}
+};
+
+class TriangleMesh final : public Geometry {
+public:
     BoundingBox root_box = BoundingBox();
-    unsigned char *uv;
-    int uvx, uvy, n;
+    Texture texture;
+    std::vector<double> texture_lod; // per triangle, log2 of the texel/world area ratio
+    std::vector<double> area_cdf;
 
     explicit TriangleMesh(const char* obj, const char* uv_file, Vector ori, double rescale = 1, Vector (*m)(double) = &constant_position, Procedural* proc = nullptr, bool is_mirror = false){
         readOBJ(obj);
@@ -544,17 +1147,82 @@ public:
                 vertices[i] = vertices[i]*rescale;
             }
         }
-        
-        if (stbi_info(uv_file, &uvx, &uvy, &n) == 0){
-            throw "Error loading UV file";
-        }
-        uv = stbi_load(uv_file, &uvx, &uvy, &n, 0);
+
+        texture = Texture(uv_file);
         generate_bounding_tree();
+        // The tree reorders the triangles, per triangle data comes after it
+        generate_texture_lod();
+        generate_area_cdf();
+    }
+
+    void generate_area_cdf(){
+        // Cumulated triangle areas, to sample the mesh uniformly when it emits
+        area_cdf.resize(indices.size());
+        double total = 0;
+        for (size_t i=0; i<indices.size(); ++i){
+            const TriangleIndices& index = indices[i];
+            total += cross(vertices[index.vtxj] - vertices[index.vtxi], vertices[index.vtxk] - vertices[index.vtxi]).norm()/2;
+            area_cdf[i] = total;
+        }
+    }
+
+    double area() override {
+        return area_cdf.empty() ? 0 : area_cdf.back();
+    }
+
+    double sample_emitter(const Vector& from, double time, double u1, double u2, Vector& point, Vector& normal) override {
+        // Uniform on the surface: a triangle by area, then a uniform point in it
+        if (!(area() > 0)){
+            return 0;
+        }
+        double target = u1*area();
+        size_t i = std::min<size_t>(std::lower_bound(area_cdf.begin(), area_cdf.end(), target) - area_cdf.begin(), indices.size()-1);
+        const TriangleIndices& index = indices[i];
+        // u1 rescaled within the triangle's share of the area is still uniform
+        double below = (i > 0) ? area_cdf[i-1] : 0;
+        double su = sqrt(std::min(1.0, std::max(0.0, (target - below)/(area_cdf[i] - below))));
+        double v = u2;
+        Vector A = vertices[index.vtxi];
+        Vector B = vertices[index.vtxj];
+        Vector C = vertices[index.vtxk];
+        point = position(time) + (1 - su)*A + su*(1 - v)*B + su*v*C;
+        normal = cross(B - A, C - A);
+        normal.normalize();
+        return area_to_solid_angle(from, point, normal)/area();
+    }
+
+    double emitter_pdf(const Vector& from, const Vector& point, const Vector& normal, double time) override {
+        (void)time;
+        return area_to_solid_angle(from, point, normal)/area();
+    }
+
+    Vector wrapped_uv(int uv_index){
+        Vector uv = uvs[uv_index];
+        return Vector(uv[0] - std::floor(uv[0]), uv[1] - std::floor(uv[1]), 0);
+    }
+
+    void generate_texture_lod(){
+        // Ray cone texture LOD: the per-triangle part only depends on the texel and world areas
+        texture_lod.resize(indices.size());
+        for (size_t i=0; i<indices.size(); ++i){
+            const TriangleIndices& index = indices[i];
+            double world_area = cross(vertices[index.vtxj] - vertices[index.vtxi], vertices[index.vtxk] - vertices[index.vtxi]).norm();
+            double texel_area = texture.width() * texture.height() * cross(wrapped_uv(index.uvj) - wrapped_uv(index.uvi), wrapped_uv(index.uvk) - wrapped_uv(index.uvi)).norm();
+            texture_lod[i] = (world_area > 0 && texel_area > 0) ? 0.5 * std::log2(texel_area/world_area) : 0;
+        }
     }
 
     void generate_bounding_tree() {
         generate_bounding();
-        root_box.split_boxes(indices, vertices);
+        root_box.split_boxes(indices, [this](const TriangleIndices& index, Vector& pmin, Vector& pmax, Vector& baryc){
+            pmin = uvec(std::numeric_limits<double>::max());
+            pmax = uvec(std::numeric_limits<double>::lowest());
+            for (Vector vertex : {vertices[index.vtxi], vertices[index.vtxj], vertices[index.vtxk]}){
+                min_vec(pmin, vertex);
+                max_vec(pmax, vertex);
+            }
+            baryc = (vertices[index.vtxi]+vertices[index.vtxj]+vertices[index.vtxk])/3;
+        });
     }
 
     void generate_bounding(){
@@ -567,66 +1235,114 @@ public:
         root_box.indexmax = indices.size();
     }
 
-    Vector vertext(double time, size_t index){return vertices[index] + origin + movement(time);}
-	
-    Cast intersect_r(Ray &r, double time) override {
+    void local_bounds(Vector &pmin, Vector &pmax) override {
+        pmin = root_box.pmin;
+        pmax = root_box.pmax;
+    }
+
+    void bake_origin() override {
+        for (size_t i = 0; i<vertices.size(); ++i){
+            vertices[i] = vertices[i] + origin;
+        }
+        root_box.translate(origin);
+        origin = Vector(0,0,0);
+    }
+
+    Hit intersect_r(Ray &r, double time) override {
         if (indices.size() == 0){
-            return Cast();
+            return Hit();
         }
+        // The ray is moved into the mesh frame once instead of moving every vertex; t is unchanged
+        Ray local = r;
+        local.origin = r.origin - position(time);
         std::vector<BoundingBox*> pile = {&root_box};
-        Cast best_cast = Cast();
+        Hit best_hit = Hit();
         while (pile.size()>0){
             BoundingBox* current_box = pile.back();
             pile.pop_back();
-            double abs_dist_to_box = current_box->intersect_box(r, origin + movement(time));
-            if (abs_dist_to_box >= 0 && abs_dist_to_box < best_cast.intersect.t){
+            double abs_dist_to_box = current_box->intersect_box(local, Vector(0,0,0));
+            if (abs_dist_to_box >= 0 && abs_dist_to_box < best_hit.t){
                 // We consider only "positive" (-1 is no intersection)
                 // We consider only boxes closer than the best intersection found by now
                 if (current_box->is_leaf){
-                    Cast current_cast = intersect_aux(r, time, current_box->indexmin, current_box->indexmax);
-                    if (current_cast.intersect.flag == true && current_cast.intersect.t < best_cast.intersect.t){
-                        best_cast = current_cast;
+                    Hit current_hit = intersect_aux(local, current_box->indexmin, current_box->indexmax);
+                    if (current_hit.flag == true && current_hit.t < best_hit.t){
+                        best_hit = current_hit;
                     }
                 } else {
-                    pile.push_back(current_box->left_child);
-                    pile.push_back(current_box->right_child);
+                    pile.push_back(current_box->left_child.get());
+                    pile.push_back(current_box->right_child.get());
                 }
             }
 
         }
-        return best_cast;
+        return best_hit;
+    }
+
+    bool occluded(Ray &r, double tmax, double time) override {
+        if (indices.size() == 0){
+            return false;
+        }
+        // Same traversal as intersect_r but we stop at the first triangle hit before tmax
+        Ray local = r;
+        local.origin = r.origin - position(time);
+        std::vector<BoundingBox*> pile = {&root_box};
+        while (pile.size()>0){
+            BoundingBox* current_box = pile.back();
+            pile.pop_back();
+            // Pruned on the entry distance: a box the ray starts in may hold an occluder before tmax even if it is left beyond
+            double entry, leave;
+            if (current_box->box_interval(local, Vector(0,0,0), entry, leave) && std::max(0.0, entry) < tmax){
+                if (current_box->is_leaf){
+                    for (size_t i=current_box->indexmin; i<current_box->indexmax; ++i){
+                        const TriangleIndices& index = indices[i];
+                        if (triangle_occluded(vertices[index.vtxi], vertices[index.vtxj], vertices[index.vtxk], local, tmax)){
+                            return true;
+                        }
+                    }
+                } else {
+                    pile.push_back(current_box->left_child.get());
+                    pile.push_back(current_box->right_child.get());
+                }
+            }
+        }
+        return false;
     }
 
-    Cast intersect_aux(Ray &r, double time, size_t indexmin, size_t indexmax) {
-        TriangleIndices index = indices[indexmin];
-        IntersectParam best_interparam = triangle_intersect(vertext(time, index.vtxi), vertext(time, index.vtxj), vertext(time, index.vtxk), r, normals[index.ni], normals[index.nj], normals[index.nk]);
-        size_t best_index = indexmin;
-        for (size_t i=indexmin+1; i<indexmax; ++i){
-            index = indices[i];
-            IntersectParam current_interparam = triangle_intersect(vertext(time, index.vtxi), vertext(time, index.vtxj), vertext(time, index.vtxk), r, normals[index.ni], normals[index.nj], normals[index.nk]);
-            if (best_interparam.intersect.flag == false || (current_interparam.intersect.flag == true && current_interparam.intersect.t < best_interparam.intersect.t)){
-                best_interparam = current_interparam;
-                best_index = i;
+    Hit intersect_aux(Ray &r, size_t indexmin, size_t indexmax) {
+        Hit best_hit = Hit();
+        for (size_t i=indexmin; i<indexmax; ++i){
+            const TriangleIndices& index = indices[i];
+            Hit current_hit = triangle_intersect(vertices[index.vtxi], vertices[index.vtxj], vertices[index.vtxk], r);
+            if (current_hit.flag == true && current_hit.t < best_hit.t){
+                best_hit = current_hit;
+                best_hit.primitive = i;
             }
         }
+        return best_hit;
+    }
 
-        if (best_interparam.intersect.flag == true){
-            Vector uv1 = uvs[indices[best_index].uvi];
-            uv1 = Vector(uv1[0] - std::floor(uv1[0]), uv1[1] - std::floor(uv1[1]), 0);
-            Vector uv2 = uvs[indices[best_index].uvj];
-            uv2 = Vector(uv2[0] - std::floor(uv2[0]), uv2[1] - std::floor(uv2[1]), 0);
-            Vector uv3 = uvs[indices[best_index].uvk];
-            uv3 = Vector(uv3[0] - std::floor(uv3[0]), uv3[1] - std::floor(uv3[1]), 0);
-            Vector uv_prop = (best_interparam.param[0]*uv1)+(best_interparam.param[1]*uv2)+(best_interparam.param[2]*uv3);
-            int x_pixel = std::floor(uv_prop[0] * uvx);
-            int y_pixel = std::floor((1-uv_prop[1]) * uvy);
-            unsigned char *pixel = uv + (n * (y_pixel*uvx + x_pixel));
-            Vector color = Vector(pixel[0], pixel[1], pixel[2])/255;
-            gamma_correction(color, 2.2);
-            color = color *255;
-            return Cast(best_interparam.intersect, color, refraction);
+    Cast shade_r(Ray &r, const Hit &hit, double time) override {
+        const TriangleIndices& index = indices[hit.primitive];
+        double alpha = 1 - hit.beta - hit.gamma;
+        Vector shading_normal = alpha * normals[index.ni] + hit.beta * normals[index.nj] + hit.gamma * normals[index.nk];
+        shading_normal.normalize();
+        Intersection intersection = Intersection(true, r.origin + r.unit*hit.t, hit.t, false, shading_normal);
+
+        Vector uv_prop = (alpha*wrapped_uv(index.uvi))+(hit.beta*wrapped_uv(index.uvj))+(hit.gamma*wrapped_uv(index.uvk));
+        double lod = 0;
+        double footprint = r.footprint(hit.t);
+        double cos_incidence = std::abs(dot(r.unit, shading_normal));
+        if (footprint > 0 && cos_incidence > 0){
+            lod = texture_lod[hit.primitive] + std::log2(footprint/cos_incidence);
         }
-        return Cast();
+        Vector color = texture.sample(uv_prop[0], uv_prop[1], lod) * 255;
+        (void)time;
+        Cast cast = Cast(intersection, color, refraction);
+        // The normal sample_emitter gives to its points
+        cast.geometric_normal = cross(vertices[index.vtxj] - vertices[index.vtxi], vertices[index.vtxk] - vertices[index.vtxi]);
+        cast.geometric_normal.normalize();
+        return cast;
     }
     #pragma GCC diagnostic push
     #pragma GCC diagnostic ignored "-Wformat="
@@ -810,7 +1526,7 @@ public:
 	
 };
 
-class Sphere : public Geometry {
+class Sphere final : public Geometry {
 public:
     double radius;
     Vector albedo;
@@ -822,191 +1538,1368 @@ public:
         movement = m;
         refraction = refr;
     }
-    Cast intersect_r(Ray &r, double time) override {
-        Vector origint = origin + (*movement)(time);
+    Hit intersect_r(Ray &r, double time) override {
+        Vector origint = position(time);
         Vector omc = r.origin - origint;
         double delta = pow(dot(r.unit, omc), 2) - (dot(omc, omc) - pow(radius, 2));
         if (delta<0){
-            return Cast();
+            return Hit();
         }
         double sq_delta = sqrt(delta);
         double t = dot(r.unit, origint-r.origin) - sq_delta;
-        bool inside = false;
         if (t<0){
             t += 2*sq_delta;
             if (t<0){
-                return Cast();
+                return Hit();
             }
-            inside = true;
         }
-        Vector normal = (r.origin + r.unit*t) - origint;
+        return Hit(true, t);
+    }
+    void local_bounds(Vector &pmin, Vector &pmax) override {
+        pmin = uvec(-radius);
+        pmax = uvec(radius);
+    }
+    Cast shade_r(Ray &r, const Hit &hit, double time) override {
+        Vector point = r.origin + r.unit*hit.t;
+        Vector normal = point - position(time);
         normal.normalize();
+        // The ray leaves the sphere iff it goes along the outward normal
+        bool inside = dot(r.unit, normal) > 0;
         if (inside == true){normal = -normal;}
-        return Cast(Intersection(true, r.origin + r.unit*t, t, inside, normal), albedo, refraction);
+        return Cast(Intersection(true, point, hit.t, inside, normal), albedo, refraction);
     }
-};
-
-Cast scene_intersect(std::vector<Geometry*> &scene, Ray &r, double t){
-    if (scene.size() == 0){
-        return Cast();
+    bool occluded(Ray &r, double tmax, double time) override {
+        Vector omc = r.origin - position(time);
+        double b = dot(r.unit, omc);
+        double delta = b*b - (dot(omc, omc) - radius*radius);
+        if (delta<0){
+            return false;
+        }
+        double sq_delta = sqrt(delta);
+        double t = -b - sq_delta;
+        if (t<0){
+            t = -b + sq_delta;
+        }
+        return (t>0 && t<tmax);
+    }
+    double area() override {
+        return 4*PI*radius*radius;
     }
-    Cast best = scene[0]->intersect(r, t);
-    for (size_t i=1; i<scene.size(); ++i){
-        Cast current_cast = scene[i]->intersect(r, t);
-        if (best.intersect.flag == false || (current_cast.intersect.flag == true && current_cast.intersect.t < best.intersect.t)){
-            best = current_cast;
+    double sample_emitter(const Vector& from, double time, double u1, double u2, Vector& point, Vector& normal) override {
+        // Uniform in the cone of directions subtended by the sphere
+        Vector center = position(time);
+        Vector axis = center - from;
+        double d2 = axis.norm2();
+        if (d2 <= radius*radius){
+            return 0;
         }
+        double d = sqrt(d2);
+        axis = axis/d;
+        double cos_max = sqrt(1 - radius*radius/d2);
+        double cos_theta = 1 - u1*(1 - cos_max);
+        double sin_theta = sqrt(std::max(0.0, 1 - cos_theta*cos_theta));
+        double phi = 2*PI*u2;
+        Vector T1, T2;
+        tangent_frame(axis, T1, T2);
+        Vector direction = cos(phi)*sin_theta*T1 + sin(phi)*sin_theta*T2 + cos_theta*axis;
+        // Nearest intersection of the sampled direction, clamped for directions grazing the silhouette
+        double b = -dot(direction, axis)*d;
+        double delta = std::max(0.0, b*b - (d2 - radius*radius));
+        point = from + direction*(-b - sqrt(delta));
+        normal = (point - center)/radius;
+        return 1/(2*PI*(1 - cos_max));
     }
-    return best;
-}
+    double emitter_pdf(const Vector& from, const Vector& point, const Vector& normal, double time) override {
+        (void)point; (void)normal;
+        double d2 = (position(time) - from).norm2();
+        if (d2 <= radius*radius){
+            return 0;
+        }
+        return 1/(2*PI*(1 - sqrt(1 - radius*radius/d2)));
+    }
+};
 
-Ray pixel_ray(int W, int H, int i, int j){
-    long double alpha = PI * 60/180;
-    Vector u = Vector(j-(W/2)+0.5, (H/2)-i-0.5, -W/(2*tan(alpha/2)));
-    return Ray(Vector(0, 0, 0), u);
-}
+class Plane final : public Geometry {
+public:
+    // Infinite plane through origin, normal is unit length
+    Vector normal;
+    Vector albedo;
+    explicit Plane(Vector o, Vector n, Vector c, double refr = -1, Vector (*m)(double) = &constant_position, Procedural* proc = nullptr){
+        procedural = proc;
+        origin = o;
+        normal = n;
+        normal.normalize();
+        albedo = c;
+        movement = m;
+        refraction = refr;
+    }
+    double distance(Ray &r, double time){
+        // Distance along the ray to the plane, negative or infinite if not hit
+        return dot(position(time) - r.origin, normal)/dot(r.unit, normal);
+    }
+    Hit intersect_r(Ray &r, double time) override {
+        double t = distance(r, time);
+        if (t > 0 && t < std::numeric_limits<double>::max()){
+            return Hit(true, t);
+        }
+        return Hit();
+    }
+    bool occluded(Ray &r, double tmax, double time) override {
+        double t = distance(r, time);
+        return (t > 0 && t < tmax);
+    }
+    void local_bounds(Vector &pmin, Vector &pmax) override {
+        // Unbounded except along an axis-aligned normal
+        for (int i=0; i<3; ++i){
+            bool flat = (std::abs(normal[i]) == 1);
+            pmin[i] = flat ? 0 : std::numeric_limits<double>::lowest();
+            pmax[i] = flat ? 0 : std::numeric_limits<double>::max();
+        }
+    }
+    Cast shade_r(Ray &r, const Hit &hit, double time) override {
+        (void)time;
+        // Both sides are lit, the back side counts as inside for refraction
+        bool inside = dot(r.unit, normal) > 0;
+        return Cast(Intersection(true, r.origin + r.unit*hit.t, hit.t, inside, inside ? -normal : normal), albedo, refraction);
+    }
+};
+
+class Quad final : public Geometry {
+public:
+    // Parallelogram origin + a*edge_u + b*edge_v for a, b in [0, 1]
+    Vector edge_u, edge_v;
+    Vector normal;
+    Vector w;   // cross(edge_u, edge_v)/|cross(edge_u, edge_v)|^2, gives a and b from the hit point
+    Vector albedo;
+    explicit Quad(Vector o, Vector u, Vector v, Vector c, double refr = -1, Vector (*m)(double) = &constant_position, Procedural* proc = nullptr){
+        procedural = proc;
+        origin = o;
+        edge_u = u;
+        edge_v = v;
+        Vector n = cross(u, v);
+        w = n/n.norm2();
+        normal = n;
+        normal.normalize();
+        albedo = c;
+        movement = m;
+        refraction = refr;
+    }
+    Hit intersect_r(Ray &r, double time) override {
+        Vector corner = position(time);
+        double t = dot(corner - r.origin, normal)/dot(r.unit, normal);
+        if (!(t > 0 && t < std::numeric_limits<double>::max())){
+            return Hit();
+        }
+        Vector local = r.origin + r.unit*t - corner;
+        double a = dot(w, cross(local, edge_v));
+        double b = dot(w, cross(edge_u, local));
+        if (a < 0 || a > 1 || b < 0 || b > 1){
+            return Hit();
+        }
+        return Hit(true, t, -1, a, b);
+    }
+    bool occluded(Ray &r, double tmax, double time) override {
+        Hit hit = intersect_r(r, time);
+        return (hit.flag && hit.t < tmax);
+    }
+    void local_bounds(Vector &pmin, Vector &pmax) override {
+        pmin = Vector(0,0,0);
+        pmax = Vector(0,0,0);
+        for (Vector corner : {edge_u, edge_v, edge_u + edge_v}){
+            min_vec(pmin, corner);
+            max_vec(pmax, corner);
+        }
+    }
+    Cast shade_r(Ray &r, const Hit &hit, double time) override {
+        (void)time;
+        bool inside = dot(r.unit, normal) > 0;
+        return Cast(Intersection(true, r.origin + r.unit*hit.t, hit.t, inside, inside ? -normal : normal), albedo, refraction);
+    }
+    double area() override {
+        return cross(edge_u, edge_v).norm();
+    }
+    double sample_emitter(const Vector& from, double time, double u1, double u2, Vector& point, Vector& normal) override {
+        // Uniform on the surface
+        point = position(time) + u1*edge_u + u2*edge_v;
+        normal = this->normal;
+        return area_to_solid_angle(from, point, normal)/area();
+    }
+    double emitter_pdf(const Vector& from, const Vector& point, const Vector& normal, double time) override {
+        (void)time;
+        return area_to_solid_angle(from, point, normal)/area();
+    }
+};
+
+class SphereSet final : public Geometry {
+public:
+    // Many spheres in one object: SoA arrays in BVH order, leaves are tested LANES spheres at a time
+    static const int LANES = 4;
+    std::vector<double> cx, cy, cz, radius2; // padded with LANES-1 empty spheres so vector loads never overflow
+    std::vector<double> radius;
+    std::vector<Vector> albedos;
+    std::vector<double> refractions;
+    BoundingBox root_box = BoundingBox();
+
+    // The spheres only describe center, radius, albedo and refraction; motion and procedural are shared by the set
+    explicit SphereSet(const std::vector<Sphere>& spheres, Vector (*m)(double) = &constant_position, Procedural* proc = nullptr, size_t leaf_size = 8){
+        procedural = proc;
+        origin = Vector(0,0,0);
+        movement = m;
+        refraction = -1;
+
+        std::vector<size_t> order(spheres.size());
+        for (size_t i=0; i<order.size(); ++i){order[i] = i;}
+        root_box.indexmin = 0;
+        root_box.indexmax = spheres.size();
+        for (const Sphere& sphere : spheres){
+            min_vec(root_box.pmin, sphere.origin - uvec(sphere.radius));
+            max_vec(root_box.pmax, sphere.origin + uvec(sphere.radius));
+        }
+        root_box.split_boxes(order, [&spheres](size_t i, Vector& pmin, Vector& pmax, Vector& center){
+            center = spheres[i].origin;
+            pmin = center - uvec(spheres[i].radius);
+            pmax = center + uvec(spheres[i].radius);
+        }, leaf_size);
+
+        for (size_t i : order){
+            const Sphere& sphere = spheres[i];
+            cx.push_back(sphere.origin[0]);
+            cy.push_back(sphere.origin[1]);
+            cz.push_back(sphere.origin[2]);
+            radius.push_back(sphere.radius);
+            radius2.push_back(sphere.radius*sphere.radius);
+            albedos.push_back(sphere.albedo);
+            refractions.push_back(sphere.refraction);
+        }
+        for (int i=0; i<LANES-1; ++i){
+            cx.push_back(0);
+            cy.push_back(0);
+            cz.push_back(0);
+            radius2.push_back(-1);
+        }
+    }
+
+    void local_bounds(Vector &pmin, Vector &pmax) override {
+        pmin = root_box.pmin;
+        pmax = root_box.pmax;
+    }
+
+    void bake_origin() override {
+        for (size_t i = 0; i<radius.size(); ++i){
+            cx[i] += origin[0];
+            cy[i] += origin[1];
+            cz[i] += origin[2];
+        }
+        root_box.translate(origin);
+        origin = Vector(0,0,0);
+    }
+
+    // Closest sphere of [indexmin, indexmax[ hit before t_best, the ray origin is in the set's frame
+    void intersect_leaf(const Vector& o, const Vector& u, size_t indexmin, size_t indexmax, double &t_best, int &best) const {
+        size_t i = indexmin;
+#if defined (__AVX__)
+        __m256d ox = _mm256_set1_pd(o[0]), oy = _mm256_set1_pd(o[1]), oz = _mm256_set1_pd(o[2]);
+        __m256d ux = _mm256_set1_pd(u[0]), uy = _mm256_set1_pd(u[1]), uz = _mm256_set1_pd(u[2]);
+        __m256d lane = _mm256_set_pd(3, 2, 1, 0);
+        __m256d zero = _mm256_setzero_pd();
+        for (; i < indexmax; i += LANES){
+            __m256d dx = _mm256_sub_pd(ox, _mm256_loadu_pd(&cx[i]));
+            __m256d dy = _mm256_sub_pd(oy, _mm256_loadu_pd(&cy[i]));
+            __m256d dz = _mm256_sub_pd(oz, _mm256_loadu_pd(&cz[i]));
+            __m256d b = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ux, dx), _mm256_mul_pd(uy, dy)), _mm256_mul_pd(uz, dz));
+            __m256d c = _mm256_sub_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)), _mm256_mul_pd(dz, dz)), _mm256_loadu_pd(&radius2[i]));
+            __m256d delta = _mm256_sub_pd(_mm256_mul_pd(b, b), c);
+            __m256d sq_delta = _mm256_sqrt_pd(_mm256_max_pd(delta, zero));
+            __m256d t0 = _mm256_sub_pd(_mm256_sub_pd(zero, b), sq_delta);
+            __m256d t1 = _mm256_add_pd(_mm256_sub_pd(zero, b), sq_delta);
+            __m256d t = _mm256_blendv_pd(t1, t0, _mm256_cmp_pd(t0, zero, _CMP_GT_OQ));
+            __m256d valid = _mm256_and_pd(_mm256_cmp_pd(delta, zero, _CMP_GE_OQ), _mm256_cmp_pd(t, zero, _CMP_GT_OQ));
+            valid = _mm256_and_pd(valid, _mm256_cmp_pd(t, _mm256_set1_pd(t_best), _CMP_LT_OQ));
+            valid = _mm256_and_pd(valid, _mm256_cmp_pd(lane, _mm256_set1_pd((double)(indexmax - i)), _CMP_LT_OQ));
+            int mask = _mm256_movemask_pd(valid);
+            if (mask != 0){
+                double ts[LANES];
+                _mm256_storeu_pd(ts, t);
+                for (int k=0; k<LANES; ++k){
+                    if ((mask >> k) & 1 && ts[k] < t_best){
+                        t_best = ts[k];
+                        best = i + k;
+                    }
+                }
+            }
+        }
+#endif
+        for (; i < indexmax; ++i){
+            double dx = o[0] - cx[i], dy = o[1] - cy[i], dz = o[2] - cz[i];
+            double b = u[0]*dx + u[1]*dy + u[2]*dz;
+            double delta = b*b - (dx*dx + dy*dy + dz*dz - radius2[i]);
+            if (delta < 0){continue;}
+            double sq_delta = sqrt(delta);
+            double t = (-b - sq_delta > 0) ? -b - sq_delta : -b + sq_delta;
+            if (t > 0 && t < t_best){
+                t_best = t;
+                best = i;
+            }
+        }
+    }
+
+    template <bool any_hit>
+    Hit traverse(Ray &r, double tmax, double time){
+        Ray local = r;
+        local.origin = r.origin - position(time);
+        double t_best = tmax;
+        int best = -1;
+        std::vector<BoundingBox*> pile = {&root_box};
+        while (pile.size()>0){
+            BoundingBox* current_box = pile.back();
+            pile.pop_back();
+            // Pruned on the entry distance, a box the ray starts in may hold a sphere before t_best
+            double entry, leave;
+            if (current_box->box_interval(local, Vector(0,0,0), entry, leave) && std::max(0.0, entry) < t_best){
+                if (current_box->is_leaf){
+                    intersect_leaf(local.origin, local.unit, current_box->indexmin, current_box->indexmax, t_best, best);
+                    if (any_hit && best >= 0){break;}
+                } else {
+                    pile.push_back(current_box->left_child.get());
+                    pile.push_back(current_box->right_child.get());
+                }
+            }
+        }
+        if (best < 0){
+            return Hit();
+        }
+        return Hit(true, t_best, best);
+    }
+
+    Hit intersect_r(Ray &r, double time) override {
+        return traverse<false>(r, std::numeric_limits<double>::max(), time);
+    }
+
+    bool occluded(Ray &r, double tmax, double time) override {
+        return traverse<true>(r, tmax, time).flag;
+    }
+
+    Cast shade_r(Ray &r, const Hit &hit, double time) override {
+        Vector point = r.origin + r.unit*hit.t;
+        Vector center = Vector(cx[hit.primitive], cy[hit.primitive], cz[hit.primitive]) + position(time);
+        Vector normal = (point - center)/radius[hit.primitive];
+        bool inside = dot(r.unit, normal) > 0;
+        if (inside == true){normal = -normal;}
+        return Cast(Intersection(true, point, hit.t, inside, normal), albedos[hit.primitive], refractions[hit.primitive]);
+    }
+};
 
 struct Light{
     Vector position;
     int intensity;
 };
 
-void place_camera_scene(std::vector<Geometry*> &scene, std::vector<Light> &lights, const Vector& camera_pos){
-    for (size_t i=0; i<scene.size(); ++i){
-        scene[i]->origin = scene[i]->origin - camera_pos;
+class EnvironmentMap {
+public:
+    // Equirectangular HDR image lighting the rays that escape the scene, the top row looks straight up (+y)
+    // Directions are sampled proportionally to the luminance of their pixel, by inverting a marginal CDF over the rows then the row's CDF
+    int width = 0;
+    int height = 0;
+    std::vector<float> pixels;          // linear rgb, already scaled to the renderer's units
+    std::vector<double> row_cdf;
+    std::vector<double> column_cdf;     // per row, normalized
+    std::vector<double> pixel_proba;
+
+    EnvironmentMap(const char* file, double intensity){
+        int n;
+        float *raw = stbi_loadf(file, &width, &height, &n, 3);
+        if (raw == nullptr){
+            throw "Error loading environment map";
+        }
+        // A radiance of 1 in the map shows as white
+        double scale = intensity * pow(255, 2.2);
+        pixels.resize(3*width*height);
+        for (size_t i = 0; i < pixels.size(); ++i){
+            pixels[i] = raw[i] * scale;
+        }
+        stbi_image_free(raw);
+        build_distribution();
+    }
+
+    void build_distribution(){
+        row_cdf.resize(height);
+        column_cdf.resize(width*height);
+        pixel_proba.resize(width*height);
+        double total = 0;
+        for (int y = 0; y < height; ++y){
+            // Rows near the poles cover less solid angle
+            double sin_theta = sin(PI*(y + 0.5)/height);
+            double row_total = 0;
+            for (int x = 0; x < width; ++x){
+                const float *pixel = &pixels[3*(y*width + x)];
+                double weight = (0.2126*pixel[0] + 0.7152*pixel[1] + 0.0722*pixel[2]) * sin_theta;
+                pixel_proba[y*width + x] = weight;
+                row_total += weight;
+                column_cdf[y*width + x] = row_total;
+            }
+            for (int x = 0; x < width && row_total > 0; ++x){
+                column_cdf[y*width + x] /= row_total;
+            }
+            total += row_total;
+            row_cdf[y] = total;
+        }
+        if (!(total > 0)){
+            throw "Environment map is black";
+        }
+        for (double &cumulative : row_cdf){cumulative /= total;}
+        for (double &proba : pixel_proba){proba /= total;}
+    }
+
+    static Vector direction(double u, double v){
+        double theta = PI*v;
+        double phi = 2*PI*u;
+        return Vector(sin(theta)*cos(phi), cos(theta), sin(theta)*sin(phi));
+    }
+
+    void pixel(const Vector& direction, int &x, int &y) const {
+        double phi = atan2(direction[2], direction[0]);
+        if (phi < 0){phi += 2*PI;}
+        double theta = acos(std::min(1.0, std::max(-1.0, direction[1])));
+        x = std::min(width-1, (int)(phi/(2*PI)*width));
+        y = std::min(height-1, (int)(theta/PI*height));
+    }
+
+    Vector radiance(const Vector& direction) const {
+        int x, y;
+        pixel(direction, x, y);
+        const float *value = &pixels[3*(y*width + x)];
+        return Vector(value[0], value[1], value[2]);
+    }
+
+    double pdf(const Vector& direction) const {
+        // Solid angle density: the pixel's probability spread uniformly over its (u, v) rectangle
+        int x, y;
+        pixel(direction, x, y);
+        double sin_theta = sqrt(std::max(0.0, 1 - direction[1]*direction[1]));
+        return (sin_theta > 0) ? pixel_proba[y*width + x]*width*height/(2*PI*PI*sin_theta) : 0;
+    }
+
+    static double rescale(double u, const double *cdf, int i){
+        // Position of u within the interval of the cdf it fell into, uniform again
+        double below = (i > 0) ? cdf[i-1] : 0;
+        return (cdf[i] > below) ? std::min(std::max((u - below)/(cdf[i] - below), 0.0), std::nextafter(1.0, 0.0)) : 0.5;
+    }
+
+    double sample(double u1, double u2, Vector& sampled) const {
+        // u1 picks the row and u2 the column, each then rescaled to place the direction within the pixel
+        int y = std::min<int>(height-1, std::upper_bound(row_cdf.begin(), row_cdf.end(), u1) - row_cdf.begin());
+        const double *row = &column_cdf[y*width];
+        int x = std::min<int>(width-1, std::upper_bound(row, row + width, u2) - row);
+        sampled = direction((x + rescale(u2, row, x))/width, (y + rescale(u1, row_cdf.data(), y))/height);
+        return pdf(sampled);
+    }
+};
+
+class LightTree {
+public:
+    // BVH over the point lights, each node knows the total intensity below it and leaves hold one light
+    struct Node{
+        Vector pmin, pmax;
+        double intensity;
+        int left, right;    // children, -1 for leaves
+        int light;          // index in the lights for leaves
+    };
+    std::vector<Node> nodes;
+    static const size_t MIN_LIGHTS = 16; // below that sample_light's linear scan is cheaper, the tree stays empty
+
+    void build(const std::vector<Light>& lights){
+        nodes.clear();
+        if (lights.size() < MIN_LIGHTS){
+            return;
+        }
+        std::vector<int> order(lights.size());
+        std::iota(order.begin(), order.end(), 0);
+        nodes.reserve(2*lights.size());
+        build_node(lights, order, 0, order.size());
+    }
+
+    int build_node(const std::vector<Light>& lights, std::vector<int>& order, size_t begin, size_t end){
+        // Median split along the largest side
+        int id = nodes.size();
+        nodes.push_back(Node());
+        Node node {uvec(std::numeric_limits<double>::max()), uvec(std::numeric_limits<double>::lowest()), 0, -1, -1, -1};
+        for (size_t i=begin; i<end; ++i){
+            min_vec(node.pmin, lights[order[i]].position);
+            max_vec(node.pmax, lights[order[i]].position);
+            node.intensity += lights[order[i]].intensity;
+        }
+        if (end - begin == 1){
+            node.light = order[begin];
+        } else {
+            Vector extent = node.pmax - node.pmin;
+            int axis = (extent[0] >= extent[1] && extent[0] >= extent[2]) ? 0 : ((extent[1] >= extent[2]) ? 1 : 2);
+            size_t middle = (begin + end)/2;
+            std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end, [&lights, axis](int a, int b){
+                return lights[a].position[axis] < lights[b].position[axis];
+            });
+            node.left = build_node(lights, order, begin, middle);
+            node.right = build_node(lights, order, middle, end);
+        }
+        nodes[id] = node;
+        return id;
+    }
+
+    double importance(const Node& node, const Vector& position, const Vector& normal) const {
+        // Intensity over a distance that can't go below the box size, 0 when the whole box is below the surface
+        bool above = false;
+        for (int c=0; c<8 && !above; ++c){
+            Vector corner = Vector((c&1) ? node.pmax[0] : node.pmin[0], (c&2) ? node.pmax[1] : node.pmin[1], (c&4) ? node.pmax[2] : node.pmin[2]);
+            above = dot(normal, corner - position) > 0;
+        }
+        if (!above){
+            return 0;
+        }
+        double distance2 = ((node.pmin + node.pmax)/2 - position).norm2();
+        return node.intensity/std::max(distance2, (node.pmax - node.pmin).norm2()/4);
+    }
+
+    // Returns a light index and its probability, -1 if no light can reach the point
+    int sample(const Vector& position, const Vector& normal, double &proba, double u) const {
+        proba = 1;
+        int current = 0;
+        while (nodes[current].left >= 0){
+            double left = importance(nodes[nodes[current].left], position, normal);
+            double right = importance(nodes[nodes[current].right], position, normal);
+            if (!(left + right > 0)){
+                return -1;
+            }
+            double proba_left = left/(left + right);
+            // The same uniform is rescaled at every level
+            if (u < proba_left){
+                u = u/proba_left;
+                proba *= proba_left;
+                current = nodes[current].left;
+            } else {
+                u = (u - proba_left)/(1 - proba_left);
+                proba *= 1 - proba_left;
+                current = nodes[current].right;
+            }
+            u = std::min(u, std::nextafter(1.0, 0.0));
+        }
+        return nodes[current].light;
+    }
+};
+
+class IrradianceCache {
+public:
+    /*
+        Hashed world space grid of the light reaching diffuse surfaces, to end the paths after their first diffuse bounce
+        A cell is a cube of cell_size, a quantized normal and a number of remaining bounces, so a lookup only returns estimates
+        built with as many bounces as the path would have followed; far away cells (beyond 32768 cells from the origin) alias
+        Each record stores the outgoing radiance a white surface would have there (direct and indirect lighting, not emission),
+        lookups return the mean of the records once a cell holds min_samples of them; a filled cell still sends min_samples/count
+        of its paths on so that they refine it, its records growing with the square root of its lookups instead of stopping
+        Cells are spread over shards, each behind its own lock, so the threads rarely wait for each other
+    */
+    static const int max_records = 16;  // hits a path records at most (one per diffuse bounce), the deeper ones only read the cache
+    IrradianceCache(double cell_size, int min_samples) : cell_size(cell_size), min_samples(min_samples) {}
+
+    uint64_t key(const Vector& position, const Vector& normal, int remaining_depth) const {
+        uint64_t key = 0;
+        for (int c = 0; c < 3; ++c){
+            key = (key << 16) | ((uint64_t)(int64_t)floor(position[c]/cell_size) & 0xffff);
+        }
+        int bucket = 0;
+        for (int c = 0; c < 3; ++c){
+            bucket = 5*bucket + (int)round(2*normal[c]) + 2;
+        }
+        return (key << 15) | ((uint64_t)bucket << 8) | ((uint64_t)remaining_depth & 0xff);
+    }
+
+    bool lookup(uint64_t key, double u, Vector &irradiance){
+        // u uniform in [0, 1) picks the paths that refine a filled cell, false for them as for the cells not filled yet
+        Shard &shard = shards[shard_index(key)];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        ++shard.lookups;
+        auto cell = shard.cells.find(key);
+        if (cell == shard.cells.end() || cell->second.count < min_samples || u * cell->second.count < min_samples){
+            return false;
+        }
+        irradiance = cell->second.sum/cell->second.count;
+        ++shard.hits;
+        return true;
+    }
+
+    void record(uint64_t key, const Vector& irradiance){
+        Shard &shard = shards[shard_index(key)];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        Cell &cell = shard.cells[key];
+        cell.sum = cell.sum + irradiance;
+        ++cell.count;
+    }
+
+    void statistics(size_t &cells, uint64_t &lookups, uint64_t &hits){
+        // Sums of the shards, the counts are kept per shard under its lock so the threads share no counter
+        cells = 0;
+        lookups = 0;
+        hits = 0;
+        for (Shard &shard : shards){
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            cells += shard.cells.size();
+            lookups += shard.lookups;
+            hits += shard.hits;
+        }
+    }
+
+    const double cell_size;
+    const int min_samples;
+
+private:
+    struct Cell{
+        Vector sum = Vector(0,0,0);
+        int count = 0;
+    };
+    struct Shard{
+        std::mutex mutex;
+        std::unordered_map<uint64_t, Cell> cells;
+        uint64_t lookups = 0;
+        uint64_t hits = 0;
+    };
+    static const int n_shards = 256;
+    Shard shards[n_shards];
+
+    static size_t shard_index(uint64_t key){
+        return (key * 0x9e3779b97f4a7c15) >> 56;
+    }
+};
+
+template <class... Types>
+class TypedScene {
+public:
+    // Objects grouped by concrete type in contiguous arrays, so the intersection loops need no virtual call.
+    // The object id of a hit counts the objects of the previous types first, then the index in its array
+    std::tuple<std::vector<Types>...> objects;
+
+    bool has_motion = true;
+    LightTree light_tree;
+    // Area lights, picked proportionally to their power
+    std::vector<int> emitters;
+    std::vector<double> emitter_cdf;
+    std::vector<double> emitter_proba;  // per object id, 0 for objects not emitting
+    std::unique_ptr<EnvironmentMap> environment;    // radiance of the rays escaping the scene, black if null
+    std::unique_ptr<IrradianceCache> irradiance_cache;  // reused by the paths after their first diffuse bounce, none if null
+
+    // To call once the scene is complete and placed: static objects bake their origin and skip motion from now on
+    void prepare(){
+        has_motion = false;
+        emitters.clear();
+        emitter_cdf.clear();
+        emitter_proba.assign(size(), 0);
+        double total_power = 0;
+        int id = 0;
+        for_each([&](Geometry& object){
+            object.moving = (object.movement != &constant_position);
+            if (object.moving){
+                has_motion = true;
+            } else {
+                object.bake_origin();
+            }
+            double power = (object.emission[0] + object.emission[1] + object.emission[2]) * object.area();
+            if (power > 0){
+                total_power += power;
+                emitters.push_back(id);
+                emitter_cdf.push_back(total_power);
+                emitter_proba[id] = power;
+            }
+            ++id;
+        });
+        for (double &proba : emitter_proba){
+            proba /= total_power;
+        }
+    }
+
+    int sample_emitter(double u){
+        // Id of an area light, with probability emitter_proba[id]
+        size_t k = std::upper_bound(emitter_cdf.begin(), emitter_cdf.end(), u*emitter_cdf.back()) - emitter_cdf.begin();
+        return emitters[std::min(k, emitters.size()-1)];
+    }
+
+    template <class T>
+    std::vector<T>& all(){
+        return std::get<std::vector<T>>(objects);
+    }
+
+    template <class T>
+    void add(T &&object){
+        all<std::decay_t<T>>().push_back(std::forward<T>(object));
+    }
+
+    template <class T, class... Others>
+    void add(T &&object, Others&&... others){
+        add(std::forward<T>(object));
+        add(std::forward<Others>(others)...);
+    }
+
+    template <class Function>
+    void for_each_type(Function f){
+        std::apply([&f](auto&... arrays){(f(arrays), ...);}, objects);
+    }
+
+    template <class Function>
+    void for_each(Function f){
+        for_each_type([&f](auto& array){
+            for (Geometry& object : array){f(object);}
+        });
+    }
+
+    size_t size(){
+        size_t total = 0;
+        for_each_type([&total](auto& array){total += array.size();});
+        return total;
+    }
+
+    Geometry& object(int id){
+        Geometry* found = nullptr;
+        size_t offset = 0;
+        for_each_type([&](auto& array){
+            if (found == nullptr && (size_t)id < offset + array.size()){found = &array[id - offset];}
+            offset += array.size();
+        });
+        return *found;
+    }
+
+    Hit intersect(Ray &r, double t){
+        Hit best = Hit();
+        size_t offset = 0;
+        for_each_type([&](auto& array){
+            for (size_t i=0; i<array.size(); ++i){
+                Hit current_hit = array[i].intersect_r(r, t);
+                if (current_hit.flag == true && current_hit.t < best.t){
+                    best = current_hit;
+                    best.object = offset + i;
+                }
+            }
+            offset += array.size();
+        });
+        return best;
+    }
+
+    bool occluded(Ray &r, double tmax, double t){
+        return std::apply([&](auto&... arrays){return (occluded_in(arrays, r, tmax, t) || ...);}, objects);
+    }
+
+    template <class T>
+    static bool occluded_in(std::vector<T>& array, Ray &r, double tmax, double t){
+        for (T& object : array){
+            if (object.occluded(r, tmax, t)){
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+using Scene = TypedScene<Sphere, Plane, Quad, SphereSet, TriangleMesh>;
+
+Cast scene_intersect(Scene &scene, Ray &r, double t){
+    Hit best = scene.intersect(r, t);
+    if (best.flag == false){
+        return Cast();
+    }
+    // Only the closest hit gets its normal, texture and procedural evaluated
+    Cast cast = scene.object(best.object).shade(r, best, t);
+    cast.object = best.object;
+    return cast;
+}
+
+bool scene_occluded(Scene &scene, Ray &r, double tmax, double t){
+    return scene.occluded(r, tmax, t);
+}
+
+Ray pixel_ray(int W, int H, int i, int j){
+    long double alpha = PI * 60/180;
+    Vector u = Vector(j-(W/2)+0.5, (H/2)-i-0.5, -W/(2*tan(alpha/2)));
+    return Ray(Vector(0, 0, 0), u, 0, 2*tan(alpha/2)/W);
+}
+
+double light_strength(const Light& light, const Vector& position, const Vector& normal){
+    // Unshadowed irradiance from the light
+    Vector to_light = light.position - position;
+    double d2 = to_light.norm2();
+    return light.intensity/(4*PI*d2) * std::max((double)0, dot(normal, to_light)/sqrt(d2));
+}
+
+int sample_light(const LightTree &tree, const std::vector<Light> &Lights, const Vector& position, const Vector& normal, double &strength, double &proba, double u){
+    // Picks a light with probability proportional to its strength using the uniform u, -1 if none lights the point
+    if (!tree.nodes.empty()){
+        // Many lights: O(log n) importance sampling through the light tree instead
+        int k = tree.sample(position, normal, proba, u);
+        if (k < 0){
+            return -1;
+        }
+        strength = light_strength(Lights[k], position, normal);
+        return (strength > 0) ? k : -1;
+    }
+    // The strengths go in a per thread scratch buffer so the shading loop never allocates
+    static thread_local std::vector<double> light_strengths;
+    if (light_strengths.size() < Lights.size()){
+        light_strengths.resize(Lights.size());
+    }
+    double total_strength = 0;
+    for (size_t k = 0; k < Lights.size(); ++k){
+        light_strengths[k] = light_strength(Lights[k], position, normal);
+        total_strength += light_strengths[k];
+    }
+    if (!(total_strength > 0)){
+        return -1;
     }
+    // Inversion of the cumulative distribution
+    double target = u*total_strength;
+    size_t k = 0;
+    double cumulative = light_strengths[0];
+    while (k+1 < Lights.size() && (cumulative <= target || light_strengths[k] == 0)){
+        ++k;
+        cumulative += light_strengths[k];
+    }
+    while (light_strengths[k] == 0){
+        --k; // rounding pushed the target past the last lit light
+    }
+    strength = light_strengths[k];
+    proba = strength/total_strength;
+    return k;
+}
+
+void place_camera_scene(Scene &scene, std::vector<Light> &lights, const Vector& camera_pos){
+    scene.for_each([&camera_pos](Geometry& object){
+        object.origin = object.origin - camera_pos;
+    });
     for (size_t i=0; i<lights.size(); ++i){
         lights[i].position = lights[i].position - camera_pos;
     }
 }
 
-Vector random_cos(const Vector &N, const double r1i, const double r2i, std::mt19937 *generator){
-    double r1;
-    double r2;
-    if (r1i == -1){
-        std::uniform_real_distribution<double> udis(0.000001,0.999999);
-        r1 = udis(*generator);
-        r2 = udis(*generator);
+uint32_t reverse_bits(uint32_t x){
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+    x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+    x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+    x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+    return x;
+}
+
+uint32_t hash_combine(uint32_t seed, uint32_t value){
+    // Mixes value into seed, murmur3's finalizer on the boost style combination
+    uint32_t x = seed ^ (value + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+    x ^= x >> 16;
+    x *= 0x85ebca6b;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35;
+    x ^= x >> 16;
+    return x;
+}
+
+uint64_t splitmix64(uint64_t x){
+    x += 0x9e3779b97f4a7c15;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+}
+
+class PCG32 {
+public:
+    /*
+        PCG XSH RR (O'Neill): 16 bytes of state instead of the 2.5 KB of std::mt19937, cheap enough to seed one per sample
+        (seed, stream) names the sequence, both are hashed so that neighbouring pixels and sample indices give unrelated numbers
+        It is a UniformRandomBitGenerator, the std distributions accept it
+    */
+    typedef uint32_t result_type;
+    PCG32(uint64_t seed, uint64_t stream){
+        increment = (splitmix64(stream) << 1) | 1;
+        state = 0;
+        (*this)();
+        state += splitmix64(seed ^ increment);
+        (*this)();
     }
-    else{
-        r1 = r1i;
-        r2 = r2i;
+    static constexpr result_type min() {return 0;}
+    static constexpr result_type max() {return 0xffffffff;}
+    result_type operator()(){
+        uint64_t old = state;
+        state = old * 6364136223846793005ULL + increment;
+        uint32_t xorshifted = ((old >> 18) ^ old) >> 27;
+        uint32_t rotation = old >> 59;
+        return (xorshifted >> rotation) | (xorshifted << ((32 - rotation) & 31));
     }
-    
+
+private:
+    uint64_t state;
+    uint64_t increment;
+};
+
+uint32_t owen_scramble(uint32_t x, uint32_t seed){
+    // Nested uniform scrambling of the bits of x from the highest one, hashed instead of stored (Laine-Karras, Burley's constants)
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47c;
+    x ^= x * 0xb82f1e52;
+    x ^= x * 0xc7afe638;
+    x ^= x * 0x8d22f6e6;
+    return reverse_bits(x);
+}
+
+uint32_t permute(uint32_t i, uint32_t l, uint32_t p){
+    // Element i of the permutation of [0, l) given by the seed p, without storing it (Kensler, cycle walking on a hashed bijection)
+    uint32_t w = l - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= p; i *= 0xe170893d; i ^= p >> 16; i ^= (i & w) >> 4;
+        i ^= p >> 8; i *= 0x0929eb3f; i ^= p >> 23; i ^= (i & w) >> 1;
+        i *= 1 | p >> 27; i *= 0x6935fa69; i ^= (i & w) >> 11; i *= 0x74dcb303;
+        i ^= (i & w) >> 2; i *= 0x9e501cc3; i ^= (i & w) >> 2; i *= 0xc860a3df;
+        i &= w; i ^= i >> 5;
+    } while (i >= l);
+    return (i + p) % l;
+}
+
+class Sampler {
+public:
+    /*
+        Uniform numbers in [0, 1) for the paths of a pixel: start() selects a sample of the pixel, get() reads one of its dimensions
+        Every use of randomness along a path has its own dimension, so low discrepancy samplers spread the samples of a pixel evenly
+        over each of them and over the pairs (2k, 2k+1): the camera comes first, then a block of BOUNCE_DIMENSIONS per diffuse hit
+        Discrete choices not worth a dimension (fresnel events) use random() instead
+    */
+    enum Dimension {PIXEL = 0, LENS = 2, TIME = 4, CAMERA_DIMENSIONS = 6};
+    enum Slot {BSDF = 0, LIGHT = 2, ROULETTE = 3, EMITTER = 4, EMITTER_POINT = 6, ENVIRONMENT = 8, BOUNCE_DIMENSIONS = 10};
+    int bounce = 0;     // diffuse hit whose slots get(Slot) reads
+
+    virtual ~Sampler() {}
+    void start(uint32_t pixel_seed, uint32_t sample_index){
+        // pixel_seed decorrelates the pixels, sample_index counts the samples already taken in this one
+        // Together they are the whole state of the sample, so any thread can render any pixel with the same result
+        seed = pixel_seed;
+        index = sample_index;
+        generator = PCG32(pixel_seed, sample_index);
+        bounce = 0;
+    }
+    double get(Dimension dimension, int offset = 0){
+        return value(dimension + offset);
+    }
+    double get(Slot slot, int offset = 0){
+        return value(CAMERA_DIMENSIONS + bounce*BOUNCE_DIMENSIONS + slot + offset);
+    }
+    double random(){
+        return to_unit(generator());
+    }
+
+protected:
+    uint32_t seed = 0;
+    uint32_t index = 0;
+    PCG32 generator = PCG32(0, 0);
+    virtual double value(uint32_t dimension) = 0;
+    static double to_unit(uint32_t bits){
+        return bits * (1.0/4294967296.0);
+    }
+};
+
+class RandomSampler final : public Sampler {
+    // Independent pseudo-random numbers, the reference the others are compared to
+protected:
+    double value(uint32_t dimension) override {
+        (void)dimension;
+        return random();
+    }
+};
+
+class SobolSampler final : public Sampler {
+    /*
+        Owen scrambled Sobol points, padded to any number of dimensions as in Burley's "Practical hash-based Owen scrambling":
+        each pair of dimensions takes the first two Sobol dimensions of an Owen scrambled (shuffled) index, with its own scrambling seeds
+        Any power of two prefix of the samples of a pixel is stratified in each pair
+    */
+protected:
+    static uint32_t sobol(uint32_t index, int dimension){
+        if (dimension == 0){
+            return reverse_bits(index);
+        }
+        // Direction numbers of the second dimension: v_k = v_(k-1) ^ (v_(k-1) >> 1)
+        uint32_t result = 0;
+        for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1){
+            if (index & 1){
+                result ^= v;
+            }
+        }
+        return result;
+    }
+    double value(uint32_t dimension) override {
+        uint32_t pair_seed = hash_combine(seed, dimension/2);
+        uint32_t shuffled = owen_scramble(index, pair_seed);
+        return to_unit(owen_scramble(sobol(shuffled, dimension % 2), hash_combine(pair_seed, dimension % 2)));
+    }
+};
+
+class HaltonSampler final : public Sampler {
+    /*
+        Halton points with the base of each dimension the next prime, their digits scrambled with a random permutation per node of the
+        digit tree (a hashed Owen scrambling) so that the pairs of high bases don't fall on lines
+        Dimensions past the prime table fall back to random numbers
+    */
+protected:
+    static const std::vector<uint32_t>& primes(){
+        static const std::vector<uint32_t> table = [](){
+            std::vector<uint32_t> found;
+            for (uint32_t n = 2; found.size() < 64; ++n){
+                bool prime = true;
+                for (uint32_t p : found){
+                    prime = prime && (n % p != 0);
+                }
+                if (prime){
+                    found.push_back(n);
+                }
+            }
+            return found;
+        }();
+        return table;
+    }
+    double value(uint32_t dimension) override {
+        if (dimension >= primes().size()){
+            return random();
+        }
+        uint32_t base = primes()[dimension];
+        uint32_t node = hash_combine(seed, dimension);
+        uint32_t remaining = index;
+        double inverse_base = 1.0/base;
+        double scale = inverse_base;
+        double result = 0;
+        do {
+            uint32_t digit = remaining % base;
+            remaining /= base;
+            result += permute(digit, base, node) * scale;
+            node = hash_combine(node, digit);
+            scale *= inverse_base;
+        } while (remaining > 0);
+        // The scrambled digits past the index's (all 0) are uniform within the interval reached, one hash places the point in it
+        result += to_unit(node) * scale * base;
+        return std::min(result, std::nextafter(1.0, 0.0));
+    }
+};
+
+class CMJSampler final : public Sampler {
+    /*
+        Correlated multi-jittered samples (Kensler), a permuted 2D pattern per pair of dimensions over pattern_size samples
+        Samples past pattern_size start new, independent patterns
+    */
+public:
+    explicit CMJSampler(int pattern_size) : size(std::max(pattern_size, 1)) {
+        columns = std::max(1, (int)sqrt(size));
+        rows = (size + columns - 1)/columns;
+    }
+
+protected:
+    uint32_t size;
+    uint32_t columns, rows;
+    static double jitter(uint32_t i, uint32_t p){
+        i ^= p; i ^= i >> 17; i ^= i >> 10; i *= 0xb36534e5; i ^= i >> 12;
+        i ^= i >> 21; i *= 0x93fc4795; i ^= 0xdf6e307f; i ^= i >> 17; i *= 1 | p >> 18;
+        return to_unit(i);
+    }
+    double value(uint32_t dimension) override {
+        uint32_t p = hash_combine(hash_combine(seed, dimension/2), index/size);
+        uint32_t s = permute(index % size, size, p * 0x51633e2d);
+        uint32_t sx = permute(s % columns, columns, p * 0xa511e9b3);
+        uint32_t sy = permute(s / columns, rows, p * 0x63d83595);
+        double result;
+        if (dimension % 2 == 0){
+            result = (s % columns + (sy + jitter(s, p * 0xa399d265))/rows)/columns;
+        } else {
+            result = (s / columns + (sx + jitter(s, p * 0x711ad6a5))/columns)/rows;
+        }
+        return std::min(result, std::nextafter(1.0, 0.0));
+    }
+};
+
+Vector random_cos(const Vector &N, double r1, double r2){
+    // Cosine distributed direction around N from two uniforms, kept off the horizon
+    r1 = std::min(std::max(r1, 0.000001), 0.999999);
+    r2 = std::min(std::max(r2, 0.000001), 0.999999);
+
     double x = cos(2*PI*r1) * sqrt(1 - r2);
     double y = sin(2*PI*r1) * sqrt(1 - r2);
     double z = sqrt(r2);
 
-    Vector T1;
-    if (abs(N.data[0]) <= abs(N.data[1]) && abs(N.data[0]) <= abs(N.data[2])){
-        T1 = Vector(0, -N.data[2], N.data[1]);
+    Vector T1, T2;
+    tangent_frame(N, T1, T2);
+
+    Vector V = x*T1 + y*T2 + z*N;
+    V.normalize();
+
+    return V;
+}
+
+Vector product_element_wise(const Vector& a, const Vector& b){
+    return Vector(a.data[0] * b.data[0], a.data[1] * b.data[1], a.data[2] * b.data[2]);
+}
+
+double power_heuristic(double pdf, double other_pdf){
+    // Multiple importance sampling weight of a strategy against another one
+    return (pdf > 0) ? pdf*pdf/(pdf*pdf + other_pdf*other_pdf) : 0;
+}
+
+Vector sample_emitters(Scene &scene, const Vector& position, const Vector& normal, const Vector& albedo, bool bounce_follows, double t, Sampler *sampler){
+    /*
+        Direct lighting from one area light picked by power, with one shadow ray
+        When a cosine sampled bounce follows it can also reach the light, both are then weighted by multiple importance sampling
+    */
+    if (scene.emitters.empty()){
+        return Vector(0,0,0);
     }
-    else if (abs(N.data[1]) <= abs(N.data[2])){
-        T1 = Vector(-N.data[2], 0, N.data[0]);
+    int id = scene.sample_emitter(sampler->get(Sampler::EMITTER));
+    Vector point, light_normal;
+    double u1 = sampler->get(Sampler::EMITTER_POINT);
+    double u2 = sampler->get(Sampler::EMITTER_POINT, 1);
+    double light_pdf = scene.emitter_proba[id] * scene.object(id).sample_emitter(position, t, u1, u2, point, light_normal);
+    if (!(light_pdf > 0)){
+        return Vector(0,0,0);
     }
-    else{
-        T1 = Vector(-N.data[1], N.data[0], 0);
+    Vector to_light = point - position;
+    double distance = to_light.norm();
+    to_light = to_light/distance;
+    double cos_surface = dot(normal, to_light);
+    if (cos_surface <= 0){
+        return Vector(0,0,0);
     }
-    T1.normalize();
-    Vector T2 = cross(N, T1);
-    T2.normalize();
+    // The light itself must not count as a blocker
+    Ray shadow_ray = Ray(position, to_light);
+    if (scene_occluded(scene, shadow_ray, distance*(1 - 1.0/100000), t)){
+        return Vector(0,0,0);
+    }
+    double weight = bounce_follows ? power_heuristic(light_pdf, cos_surface/PI) : 1;
+    return product_element_wise(scene.object(id).emission, albedo/255) * (cos_surface/PI * weight/light_pdf);
+}
+
+Vector sample_environment(Scene &scene, const Vector& position, const Vector& normal, const Vector& albedo, bool bounce_follows, double t, Sampler *sampler){
+    // Direct lighting from the environment map, with one shadow ray and weighted against the cosine sampled bounce like sample_emitters
+    if (!scene.environment){
+        return Vector(0,0,0);
+    }
+    Vector direction;
+    double pdf = scene.environment->sample(sampler->get(Sampler::ENVIRONMENT), sampler->get(Sampler::ENVIRONMENT, 1), direction);
+    double cos_surface = dot(normal, direction);
+    if (!(pdf > 0) || cos_surface <= 0){
+        return Vector(0,0,0);
+    }
+    Ray shadow_ray = Ray(position, direction);
+    if (scene_occluded(scene, shadow_ray, std::numeric_limits<double>::max(), t)){
+        return Vector(0,0,0);
+    }
+    double weight = bounce_follows ? power_heuristic(pdf, cos_surface/PI) : 1;
+    return product_element_wise(scene.environment->radiance(direction), albedo/255) * (cos_surface/PI * weight/pdf);
+}
 
-    Vector V = x*T1 + y*T2 + z*N;
-    V.normalize();
+Vector escaped_radiance(Scene &scene, const Ray& escaped, double bounce_pdf){
+    // Environment seen by a ray leaving the scene, weighted against sample_environment when it was cast by a diffuse bounce
+    if (!scene.environment){
+        return Vector(0,0,0);
+    }
+    double weight = (bounce_pdf == 0) ? 1 : power_heuristic(bounce_pdf, scene.environment->pdf(escaped.unit));
+    return scene.environment->radiance(escaped.unit) * weight;
+}
 
-    return V;
+double emission_weight(Scene &scene, const Cast &cast, const Vector& from, double bounce_pdf, double t){
+    // Weight of an area light reached by a bounce of pdf bounce_pdf from from, 1 when sample_emitters could not have picked it
+    if (bounce_pdf == 0){
+        return 1;
+    }
+    double light_pdf = scene.emitter_proba[cast.object] * scene.object(cast.object).emitter_pdf(from, cast.intersect.position, cast.geometric_normal, t);
+    return power_heuristic(bounce_pdf, light_pdf);
 }
 
-Vector normalized_product_element_wise(const Vector& a, const Vector& b){
-    return Vector(a.data[0] * b.data[0]/255, a.data[1] * b.data[1]/255, a.data[2] * b.data[2]/255);
+bool emits(const Cast &cast){
+    return cast.emission[0] > 0 || cast.emission[1] > 0 || cast.emission[2] > 0;
 }
 
-Vector get_color_aux(std::vector<Geometry*> &Scene, std::vector<Light> &Lights, Ray pr, unsigned char reflections_depth, int ray_depth, double r1i, double r2i, double t, std::mt19937 *generator){
+bool trace_to_diffuse(Scene &scene, Ray &pr, Cast &cast, int &reflections_depth, double t, Sampler *sampler){
     /*
-        Only follows one path, has to be sampled multiple times to get good results
+        Follows pr through mirrors, fresnel reflections and refractions until it hits a diffuse surface, returned in cast, pr being the ray that hit it
+        Returns false if nothing is hit or the reflections_depth budget of specular events runs out
     */
-    Vector color = Vector(0,0,0);
-    if (ray_depth < 0){return color;} // Should not happen but we never know
-    Cast cast = scene_intersect(Scene, pr, t);
     double epsilon = 1.0/100000;
-    if (cast.intersect.flag == true){
+    while (true){
+        cast = scene_intersect(scene, pr, t);
+        if (cast.intersect.flag == false){
+            return false;
+        }
+        if (!(cast.mirror || cast.transp)){
+            return true;
+        }
+        if (reflections_depth <= 0){
+            return false;
+        }
+        --reflections_depth;
         Vector normal_towards_ray = cast.intersect.normal;
-
         double dotwin = dot(pr.unit, normal_towards_ray);
+        double cone_width = pr.footprint(cast.intersect.t);
         Vector epsilon_above = cast.intersect.position + normal_towards_ray * epsilon;
-        if (cast.mirror && (reflections_depth>0)){
-            return get_color_aux(Scene, Lights, Ray(epsilon_above, pr.unit - 2 * dotwin * normal_towards_ray), reflections_depth-1, ray_depth, r1i, r2i, t, generator);
-        }
-        else if (cast.transp){
-            // We always assume the sphere is standing in air
-            // We add fresnel; if we have to reflect, then do as if it was a mirror; otherwise do normal
-            double n1 = 1.0;
-            double n2 = cast.refraction;
-            if (cast.intersect.inside == true){
-                n1 = cast.refraction;
-                n2 = 1;
-            }
-            double k0 = pow((n1 - n2), 2) / pow(n1 + n2, 2);
-            double refl_proba = k0 + (1-k0)*pow(1 - abs(dotwin), 5);
-            std::uniform_real_distribution<double> udis(0,1);
-            if (udis(*generator) < refl_proba){
-                // If we actually have reflection, reflect
-                return get_color_aux(Scene, Lights, Ray(epsilon_above, pr.unit - 2 * dotwin * normal_towards_ray), reflections_depth-1, ray_depth, r1i, r2i, t, generator);
-            }
-            // End of fresnel
-            double n1n2 = n1/n2;
-            Vector epsilon_after = cast.intersect.position - normal_towards_ray * epsilon;
-            Vector tangential_dir = n1n2 * (pr.unit - dotwin * normal_towards_ray);
-            double in_sqrt = 1 - (pow(n1n2,2) * (1 - pow(dotwin,2)));
-            if (in_sqrt<0){
-                std::cout << "WARNING: issue in refraction handling; transparent surface with mirror behaviour from value of refraction index" << std::endl; // thinks it's inside when it's not
-                // This appears when we put the camera inside the lens, for some reason it bugs
-                cast.mirror = true;
-                cast.refraction = 0;
-                cast.transp = false;
-                return get_color_aux(Scene, Lights, pr, reflections_depth, ray_depth, r1i, r2i, t, generator);
-            }
-            Vector normal_dir = - normal_towards_ray * sqrt(in_sqrt);
-            Vector refracted_direction = tangential_dir + normal_dir;
-            Ray reflected_ray = Ray(epsilon_after, refracted_direction);
-            return get_color_aux(Scene, Lights, reflected_ray, reflections_depth-1, ray_depth, r1i, r2i, t, generator);
+        Ray reflected_ray = Ray(epsilon_above, pr.unit - 2 * dotwin * normal_towards_ray, cone_width, pr.cone_spread);
+        if (cast.mirror){
+            pr = reflected_ray;
+            continue;
         }
-        Vector albedo = cast.albedo;
-
-        // We ponderate the probability of trying a light by its "strength"
-        std::vector<double> light_strength(Lights.size());
-        double total_strength = 0;
-        for (size_t k = 0; k < Lights.size(); ++k){
-            Vector to_light_s = Lights[k].position - cast.intersect.position;
-            light_strength[k] = Lights[k].intensity/(4*PI*(to_light_s).norm2()) * std::max((double)0, dot(normal_towards_ray, to_light_s/to_light_s.norm()));
-            total_strength += light_strength[k];
+        // We always assume the sphere is standing in air
+        // We add fresnel; if we have to reflect, then do as if it was a mirror; otherwise do normal
+        double n1 = 1.0;
+        double n2 = cast.refraction;
+        if (cast.intersect.inside == true){
+            n1 = cast.refraction;
+            n2 = 1;
+        }
+        double k0 = pow((n1 - n2), 2) / pow(n1 + n2, 2);
+        double refl_proba = k0 + (1-k0)*pow(1 - abs(dotwin), 5);
+        double n1n2 = n1/n2;
+        double in_sqrt = 1 - (pow(n1n2,2) * (1 - pow(dotwin,2)));
+        if (in_sqrt < 0 || sampler->random() < refl_proba){
+            // Fresnel reflection, or total internal reflection when no refracted direction exists
+            pr = reflected_ray;
+            continue;
         }
+        // End of fresnel
+        Vector epsilon_after = cast.intersect.position - normal_towards_ray * epsilon;
+        Vector tangential_dir = n1n2 * (pr.unit - dotwin * normal_towards_ray);
+        Vector normal_dir = - normal_towards_ray * sqrt(in_sqrt);
+        pr = Ray(epsilon_after, tangential_dir + normal_dir, cone_width, pr.cone_spread);
+    }
+}
+
+struct Features{
+    // First diffuse hit of a path (through mirrors and lenses), guides the denoiser; all 0 when the path found no diffuse surface
+    Vector albedo = Vector(0,0,0);  // 0 to 255, white for the paths escaping to the environment
+    Vector normal = Vector(0,0,0);  // shading normal, facing the ray
+    double depth = 0;               // distance to the camera
+};
 
-        if (total_strength > 0){
-            std::vector<double> light_proba(Lights.size());
+struct CacheRecord{
+    // Diffuse hit of a path, added to the irradiance cache once the path ends
+    uint64_t key;
+    Vector irradiance;  // outgoing radiance of a white surface there, gathered so far
+    Vector throughput;  // of the rest of the path as seen from the hit
+};
 
-            for (size_t k = 0; k < Lights.size(); ++k){
-                light_proba[k] = light_strength[k]/total_strength;
+Vector get_color_aux(Scene &scene, std::vector<Light> &Lights, Ray pr, int reflections_depth, int ray_depth, int roulette_depth, double t, Sampler *sampler, int bounces = 0, double bounce_pdf = 0, Features *features = nullptr){
+    /*
+        Only follows one path, has to be sampled multiple times to get good results
+        The path is followed iteratively: throughput is the product of the albedos (between 0 and 1) of the diffuse bounces so far,
+        reflections_depth bounds the number of specular (mirror, reflection, refraction) events and ray_depth the number of diffuse bounces
+        After roulette_depth diffuse bounces (never if negative), paths survive each bounce with a probability given by their throughput
+        bounces counts the diffuse bounces before pr, it picks the sampler dimensions of each hit
+        bounce_pdf is the pdf of the diffuse bounce that cast pr, 0 if it comes from the camera, it weights the area lights pr reaches
+        If features is not null it receives the first diffuse hit
+        With an irradiance cache, the path ends at the first hit after a diffuse bounce whose cell is filled (and not picked
+        for refinement), the hits before it are recorded into their cells
+    */
+    Vector color = Vector(0,0,0);
+    Vector throughput = Vector(1,1,1);
+    double epsilon = 1.0/100000;
+    IrradianceCache *cache = scene.irradiance_cache.get();
+    CacheRecord records[IrradianceCache::max_records];
+    int n_records = 0;
+    auto add = [&](const Vector& radiance){
+        // Radiance reaching the current hit of the path
+        color = color + product_element_wise(throughput, radiance);
+        for (int r = 0; r < n_records; ++r){
+            CacheRecord &record = records[r];
+            record.irradiance = record.irradiance + product_element_wise(record.throughput, radiance);
+        }
+    };
+    while (ray_depth >= 0){
+        Cast cast;
+        Vector from = pr.origin;
+        int specular_budget = reflections_depth;
+        bool hit = trace_to_diffuse(scene, pr, cast, reflections_depth, t, sampler);
+        if (reflections_depth != specular_budget){
+            bounce_pdf = 0; // lights seen through a mirror or a lens can't be sampled directly
+        }
+        if (!hit){
+            if (cast.intersect.flag == false){
+                add(escaped_radiance(scene, pr, bounce_pdf));
+                if (features != nullptr){
+                    features->albedo = uvec(255);
+                }
+            }
+            break;
+        }
+        Vector normal_towards_ray = cast.intersect.normal;
+        double cone_width = pr.footprint(cast.intersect.t);
+        Vector epsilon_above = cast.intersect.position + normal_towards_ray * epsilon;
+        Vector albedo = cast.albedo;
+        Vector reflectance = albedo/255;
+        sampler->bounce = bounces;
+        if (features != nullptr){
+            features->albedo = albedo;
+            features->normal = normal_towards_ray;
+            features->depth = cast.intersect.position.norm();
+            features = nullptr;
+        }
+        if (emits(cast)){
+            add(cast.emission * emission_weight(scene, cast, from, bounce_pdf, t));
+        }
+        bool cached = (cache != nullptr && bounces > 0);
+        uint64_t key = 0;
+        if (cached){
+            key = cache->key(cast.intersect.position, normal_towards_ray, ray_depth);
+            Vector irradiance;
+            if (cache->lookup(key, sampler->random(), irradiance)){
+                add(product_element_wise(reflectance, irradiance));
+                break;
             }
-            
-            std::discrete_distribution<size_t> vector_element(light_proba.begin(), light_proba.end());
-            size_t k = vector_element(*generator);
+        }
+
+        // Direct lighting, of a white surface so that the cache records don't depend on the albedo
+        Vector direct = sample_emitters(scene, epsilon_above, normal_towards_ray, uvec(255), ray_depth > 0, t, sampler);
+        direct = direct + sample_environment(scene, epsilon_above, normal_towards_ray, uvec(255), ray_depth > 0, t, sampler);
 
+        // We ponderate the probability of trying a light by its "strength"
+        double strength, proba;
+        int k = sample_light(scene.light_tree, Lights, cast.intersect.position, normal_towards_ray, strength, proba, sampler->get(Sampler::LIGHT));
+        if (k >= 0){
             // First test if there is a shadow
             Vector to_shadow = Lights[k].position - epsilon_above;
             Ray shadow_ray = Ray(epsilon_above, to_shadow);
-            Cast shadow_intersection = scene_intersect(Scene, shadow_ray, t);
-            if (!shadow_intersection.intersect.flag | (to_shadow.norm2() < (epsilon_above - shadow_intersection.intersect.position).norm2())){
+            if (!scene_occluded(scene, shadow_ray, to_shadow.norm(), t)){
                 // Then add the light to the pixel
-                color = color + ((light_strength[k]/light_proba[k]) * (albedo/PI));
+                direct = direct + (strength/proba) * (uvec(255)/PI);
             }
         }
+        throughput = product_element_wise(throughput, reflectance);
+        for (int r = 0; r < n_records; ++r){
+            CacheRecord &record = records[r];
+            record.throughput = product_element_wise(record.throughput, reflectance);
+        }
+        add(direct);
+        if (cached && n_records < IrradianceCache::max_records){
+            records[n_records++] = CacheRecord{key, direct, Vector(1,1,1)};
+        }
 
-        // We add indirect lighting
-        if (ray_depth > 0){
-            Ray diffuse_bounce = Ray(epsilon_above, random_cos(normal_towards_ray, r1i, r2i, generator));
-            color = color + normalized_product_element_wise(albedo, get_color_aux(Scene, Lights, diffuse_bounce, reflections_depth, ray_depth-1, -1, -1, t, generator));
+        // We continue with indirect lighting
+        if (ray_depth == 0){
+            break;
+        }
+        --ray_depth;
+        ++bounces;
+        if (roulette_depth >= 0 && bounces > roulette_depth){
+            // Russian roulette, dividing by the survival probability keeps the estimate unbiased
+            double survival = std::min(1.0, std::max(throughput[0], std::max(throughput[1], throughput[2])));
+            if (sampler->get(Sampler::ROULETTE) >= survival){
+                break;
+            }
+            throughput = throughput/survival;
+            for (int r = 0; r < n_records; ++r){
+                CacheRecord &record = records[r];
+                record.throughput = record.throughput/survival;
+            }
         }
+        pr = Ray(epsilon_above, random_cos(normal_towards_ray, sampler->get(Sampler::BSDF), sampler->get(Sampler::BSDF, 1)), cone_width, pr.diffuse_spread());
+        bounce_pdf = dot(normal_towards_ray, pr.unit)/PI;
+    }
+    for (int r = 0; r < n_records; ++r){
+        cache->record(records[r].key, records[r].irradiance);
     }
     return color;
 }
@@ -1018,6 +2911,28 @@ struct Settings{
     double DOF_dist;
     double DOF_radius;
     double antialiasing_strength;
+    int bake_resolution = 0;    // 0 evaluates procedurals at every hit, otherwise they are baked per object on a grid of this resolution
+    int roulette_depth = 3;     // diffuse bounces before russian roulette starts, negative disables it
+    int restir_candidates = 0;          // 0 samples one light per hit, otherwise direct lighting of primary hits is resampled from this many candidates per pass
+    size_t n_threads = 32;              // threads sharing the rows of the image, the calling thread included
+    std::string environment_map;        // HDR equirectangular image lighting the escaping rays, empty for none
+    double environment_intensity = 1;   // multiplier of the environment map radiance
+    double adaptive_threshold = 0;      // 0 gives monte_carlo_size samples to every pixel, otherwise pixels stop once their error is below it
+    int adaptive_min_samples = 16;      // samples given to every pixel before the error is first estimated, then per round
+    std::string sample_map;             // image of the samples taken per pixel, written by progressive rendering if not empty
+    double time_budget = 0;             // seconds, 0 for none, otherwise passes are rendered until it is spent
+    int save_passes = 0;                // progressive rendering writes the image so far every save_passes passes, 0 for never
+    double save_seconds = 0;            // and/or every save_seconds seconds, 0 for never
+    std::string preview_file = "image.png"; // written by progressive rendering with the image so far
+    std::string checkpoint_file;        // progressive rendering saves its state there with each intermediate image, empty for never
+    bool resume = false;                // continue the render saved in checkpoint_file
+    unsigned int seed = 0;              // seeds every random choice of the render, 0 picks one at random
+    uint64_t arguments_hash = 0;        // of the arguments the image depends on, identifies a render for checkpoints
+    std::string sampler = "sobol";      // sobol, halton, cmj or random
+    int denoise_iterations = 0;         // passes of the a-trous denoiser run on the final image, 0 for none
+    std::string feature_prefix;         // the first hit albedo, normal and depth are written to prefix_*.png if not empty
+    double cache_cell = 0;              // 0 disables the irradiance cache, otherwise the size of its cells in scene units
+    int cache_samples = 16;             // records a cache cell needs before the paths end there
     Settings() {
         reflections_depth = 20;
         ray_depth = 2;
@@ -1029,63 +2944,684 @@ struct Settings{
     Settings(int refd, int rayd, int MCS, double DOFd, double DOFr, double AS) : reflections_depth(refd), ray_depth(rayd), monte_carlo_size(MCS), DOF_dist(DOFd), DOF_radius(DOFr), antialiasing_strength(AS) {}
 };
 
-Vector get_color(std::vector<Geometry*> &Scene, std::vector<Light> &Lights, int W, int H, int ir, int jr, std::mt19937 *generator, Settings *set){
-    Vector color = Vector(0,0,0);
-    std::vector<double> r1v(set->monte_carlo_size);
-    std::vector<double> r2v(set->monte_carlo_size);
-    std::uniform_real_distribution<double> udis(0.000001,0.999999);
-    double r1, r2;
-    int size_side = sqrt(set->monte_carlo_size);
-    for (double i = 0; i<size_side; ++i){
-        for (double j = 0; j<size_side; ++j){
-            r1 = udis(*generator);
-            r2 = udis(*generator);
-            r1v[i*size_side + j] = r1*i/size_side + (1-r1)*(i+1)/size_side;
-            r2v[i*size_side + j] = r2*j/size_side + (1-r2)*(j+1)/size_side;
+std::unique_ptr<Sampler> make_sampler(const Settings *set){
+    if (set->sampler == "sobol"){
+        return std::unique_ptr<Sampler>(new SobolSampler());
+    }
+    if (set->sampler == "halton"){
+        return std::unique_ptr<Sampler>(new HaltonSampler());
+    }
+    if (set->sampler == "cmj"){
+        return std::unique_ptr<Sampler>(new CMJSampler(set->monte_carlo_size));
+    }
+    // "random", parse_options rejects the other names
+    return std::unique_ptr<Sampler>(new RandomSampler());
+}
+
+Ray camera_ray(int W, int H, int ir, int jr, Sampler *sampler, Settings *set){
+    // Ray through pixel (ir, jr) with antialiasing jitter and a depth of field lens sample
+    double r1 = std::min(std::max(sampler->get(Sampler::PIXEL), 0.000001), 0.999999);
+    double r2 = sampler->get(Sampler::PIXEL, 1);
+    double di = set->antialiasing_strength * sqrt(-2*log(r1)) * cos(2*PI*r2);
+    double dj = set->antialiasing_strength * sqrt(-2*log(r1)) * sin(2*PI*r2);
+    Ray pr = pixel_ray(W, H, ir+di, jr+dj);
+    if (set->DOF_dist > 0){
+        Vector P = pr.origin + pr.unit * set->DOF_dist/abs(pr.unit.data[2]);
+        double r = set->DOF_radius * sqrt(sampler->get(Sampler::LENS));
+        double theta = 2*PI*sampler->get(Sampler::LENS, 1);
+        pr.origin = pr.origin + Vector(r*cos(theta), r*sin(theta), 0);
+        pr.unit = P - pr.origin;
+        pr.unit.normalize();
+    }
+    return pr;
+}
+
+struct PixelAccumulator{
+    // Running sums of the samples of a pixel and of their squares, per channel, and of the samples' features
+    Vector sum = Vector(0,0,0);
+    Vector sum2 = Vector(0,0,0);
+    Features features;
+    int count = 0;
+    void add(const Vector& sample, const Features& first_hit){
+        sum = sum + sample;
+        sum2 = sum2 + product_element_wise(sample, sample);
+        features.albedo = features.albedo + first_hit.albedo;
+        features.normal = features.normal + first_hit.normal;
+        features.depth += first_hit.depth;
+        ++count;
+    }
+    Vector mean() const {
+        return (count > 0) ? sum/count : Vector(0,0,0);
+    }
+    Features mean_features() const {
+        Features mean;
+        if (count > 0){
+            mean.albedo = features.albedo/count;
+            mean.normal = features.normal/count;
+            mean.depth = features.depth/count;
         }
+        return mean;
+    }
+    double error() const {
+        // Largest standard error of the mean over the channels, converted to levels of the gamma corrected 8 bit output
+        if (count < 2){
+            return std::numeric_limits<double>::max();
+        }
+        double error = 0;
+        for (int c = 0; c < 3; ++c){
+            double mean = sum[c]/count;
+            double variance = std::max(0.0, (sum2[c] - count*mean*mean)/(count - 1));
+            double slope = pow(std::max(mean, 1.0), 1/2.2 - 1)/2.2;
+            error = std::max(error, slope * sqrt(variance/count));
+        }
+        return error;
+    }
+};
+
+void add_samples(Scene &scene, std::vector<Light> &Lights, int W, int H, int ir, int jr, Sampler *sampler, Settings *set, PixelAccumulator &pixel, int count){
+    // Adds count paths through pixel (ir, jr), they continue the pixel's sample sequence from pixel.count
+    // sampler comes from make_sampler(set), it is restarted for each path so a thread can reuse one for all its pixels
+    uint32_t pixel_seed = hash_combine(set->seed, ir*W + jr);
+    double t;
+    for (int i=0; i<count; ++i){
+        sampler->start(pixel_seed, pixel.count);
+        Ray pr = camera_ray(W, H, ir, jr, sampler, set);
+        t = scene.has_motion ? sampler->get(Sampler::TIME) : 0; // static scenes don't need shutter samples
+        Features features;
+        Vector color = get_color_aux(scene, Lights, pr, set->reflections_depth, set->ray_depth, set->roulette_depth, t, sampler, 0, 0, &features);
+        pixel.add(color, features);
+    }
+}
+
+void resolve_image(const std::vector<Vector> &colors, std::vector<unsigned char> &image){
+    for (size_t p = 0; p < colors.size(); ++p){
+        Vector color = colors[p];
+        gamma_correction(color);
+        image[p * 3 + 0] = color.data[0];
+        image[p * 3 + 1] = color.data[1];
+        image[p * 3 + 2] = color.data[2];
+    }
+}
+
+std::vector<Vector> pixel_means(const std::vector<PixelAccumulator> &pixels){
+    std::vector<Vector> colors(pixels.size());
+    for (size_t p = 0; p < pixels.size(); ++p){
+        colors[p] = pixels[p].mean();
+    }
+    return colors;
+}
+
+struct Reservoir{
+    // Weighted reservoir of light candidates for resampled direct lighting, keeps one light with probability proportional to its weight
+    int light = -1;
+    double weight_sum = 0;
+    int M = 0;          // number of candidates seen
+    double W = 0;       // contribution weight of the kept light, weight_sum/(M*target) once finalized
+    void update(int k, double weight, int count, PCG32 *generator){
+        weight_sum += weight;
+        M += count;
+        std::uniform_real_distribution<double> udis(0, 1);
+        if (weight > 0 && udis(*generator) * weight_sum < weight){
+            light = k;
+        }
+    }
+    void merge(const Reservoir &other, double target, PCG32 *generator){
+        // target is the other reservoir's light evaluated at this reservoir's pixel
+        update(other.light, target * other.W * other.M, other.M, generator);
+    }
+    void finalize(double target){
+        W = (target > 0 && M > 0) ? weight_sum / (M * target) : 0;
+    }
+};
+
+struct PrimaryHit{
+    // First diffuse surface seen through a pixel, with the indirect lighting already estimated
+    bool valid = false;
+    Vector position;
+    Vector normal;
+    Vector albedo;
+    double depth = 0;
+    Vector indirect;
+};
+
+bool similar_hits(const PrimaryHit &a, const PrimaryHit &b){
+    // Reservoirs are only reused between pixels seeing the same surface
+    return a.valid && b.valid && dot(a.normal, b.normal) > 0.9 && abs(a.depth - b.depth) < 0.1 * a.depth;
+}
+
+template <typename F>
+void parallel_rows(int H, size_t n_threads, F row){
+    // Calls row(i) for each line, in n_threads contiguous blocks, the calling thread taking the last one
+    size_t block_size = H / n_threads;
+    std::vector<std::thread> threads;
+    for (size_t b = 0; b+1 < n_threads; ++b){
+        threads.emplace_back([&row, b, block_size](){
+            for (size_t i = b*block_size; i < (b+1)*block_size; ++i){
+                row(i);
+            }
+        });
+    }
+    for (int i = (n_threads-1)*block_size; i < H; ++i){
+        row(i);
+    }
+    for (std::thread &thread : threads){
+        thread.join();
+    }
+}
+
+void render_restir(Scene &scene, std::vector<Light> &Lights, int W, int H, std::vector<PixelAccumulator> &pixels, Settings *set){
+    /*
+        Renders with resampled importance sampling of the direct lighting of primary hits (ReSTIR), one pass per monte-carlo sample
+        Each pass streams restir_candidates uniformly picked lights through a reservoir per pixel, merges it with the previous pass's reservoir
+        of the same pixel (temporal reuse) then with a few neighbouring reservoirs (spatial reuse), and only traces one shadow ray for the kept light
+        Indirect lighting is still computed by get_color_aux from the primary hit
+        pixels (width*height, empty) receives the samples
+    */
+    const size_t n_threads = set->n_threads;
+    const int neighbours = 4;
+    const double radius = 10;
+    const int history_cap = 20 * set->restir_candidates;
+    double epsilon = 1.0/100000;
+    std::vector<PrimaryHit> hits(W * H);
+    std::vector<PrimaryHit> previous_hits(W * H);
+    std::vector<Reservoir> candidates(W * H);
+    std::vector<Reservoir> reservoirs(W * H);
+    unsigned int seed = set->seed;
+
+    std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
+    int max_perten = 0;
+    for (int pass = 0; pass < set->monte_carlo_size; ++pass){
+        // Primary hits, candidates and temporal reuse
+        parallel_rows(H, n_threads, [&](int i){
+            std::unique_ptr<Sampler> sampler = make_sampler(set);
+            std::uniform_int_distribution<int> light_gen(0, std::max((int)Lights.size() - 1, 0));
+            for (int j = 0; j < W; ++j){
+                PrimaryHit &hit = hits[i*W + j];
+                hit = PrimaryHit();
+                candidates[i*W + j] = Reservoir();
+                uint32_t pixel_seed = hash_combine(seed, i*W + j);
+                PCG32 generator(pixel_seed, 2*pass);
+                sampler->start(pixel_seed, pass);
+                Ray pr = camera_ray(W, H, i, j, sampler.get(), set);
+                double t = scene.has_motion ? sampler->get(Sampler::TIME) : 0;
+                int reflections_depth = set->reflections_depth;
+                Cast cast;
+                if (!trace_to_diffuse(scene, pr, cast, reflections_depth, t, sampler.get())){
+                    if (cast.intersect.flag == false){
+                        hit.indirect = escaped_radiance(scene, pr, 0);
+                        hit.albedo = uvec(255); // as in get_color_aux's features
+                    }
+                    continue;
+                }
+                hit.valid = true;
+                hit.position = cast.intersect.position;
+                hit.normal = cast.intersect.normal;
+                hit.albedo = cast.albedo;
+                hit.depth = cast.intersect.position.norm();
+                // Area lights are not resampled, they are handled as in get_color_aux
+                Vector epsilon_above = hit.position + hit.normal * epsilon;
+                hit.indirect = emits(cast) ? cast.emission : Vector(0,0,0);
+                hit.indirect = hit.indirect + sample_emitters(scene, epsilon_above, hit.normal, hit.albedo, set->ray_depth > 0, t, sampler.get());
+                hit.indirect = hit.indirect + sample_environment(scene, epsilon_above, hit.normal, hit.albedo, set->ray_depth > 0, t, sampler.get());
+                if (set->ray_depth > 0){
+                    Vector direction = random_cos(hit.normal, sampler->get(Sampler::BSDF), sampler->get(Sampler::BSDF, 1));
+                    Ray bounce = Ray(epsilon_above, direction, pr.footprint(cast.intersect.t), pr.diffuse_spread());
+                    double bounce_pdf = dot(hit.normal, bounce.unit)/PI;
+                    hit.indirect = hit.indirect + product_element_wise(hit.albedo/255, get_color_aux(scene, Lights, bounce, reflections_depth, set->ray_depth-1, set->roulette_depth, t, sampler.get(), 1, bounce_pdf));
+                }
+
+                Reservoir &reservoir = candidates[i*W + j];
+                for (int c = 0; Lights.size() > 0 && c < set->restir_candidates; ++c){
+                    int k = light_gen(generator);
+                    // Candidates are uniform, so their weight is the target over 1/Lights.size()
+                    reservoir.update(k, light_strength(Lights[k], hit.position, hit.normal) * Lights.size(), 1, &generator);
+                }
+                const Reservoir &previous = reservoirs[i*W + j];
+                if (pass > 0 && previous.light >= 0 && similar_hits(hit, previous_hits[i*W + j])){
+                    Reservoir capped = previous;
+                    capped.M = std::min(capped.M, history_cap);
+                    reservoir.merge(capped, light_strength(Lights[capped.light], hit.position, hit.normal), &generator);
+                }
+                if (reservoir.light >= 0){
+                    reservoir.finalize(light_strength(Lights[reservoir.light], hit.position, hit.normal));
+                }
+            }
+        });
+
+        // Spatial reuse and shading
+        parallel_rows(H, n_threads, [&](int i){
+            std::uniform_real_distribution<double> offset_gen(-radius, radius);
+            std::uniform_real_distribution<double> t_gen(0, 1);
+            for (int j = 0; j < W; ++j){
+                PCG32 generator(hash_combine(seed, i*W + j), 2*pass + 1);
+                const PrimaryHit &hit = hits[i*W + j];
+                Reservoir &reservoir = reservoirs[i*W + j];
+                reservoir = Reservoir();
+                if (!hit.valid){
+                    Features features;
+                    features.albedo = hit.albedo;
+                    pixels[i*W + j].add(hit.indirect, features); // environment seen directly
+                    continue;
+                }
+                const Reservoir &own = candidates[i*W + j];
+                if (own.light >= 0){
+                    reservoir.merge(own, light_strength(Lights[own.light], hit.position, hit.normal), &generator);
+                } else {
+                    reservoir.M = own.M;
+                }
+                int used[neighbours];
+                int n_used = 0;
+                for (int n = 0; n < neighbours; ++n){
+                    int iq = i + (int)offset_gen(generator);
+                    int jq = j + (int)offset_gen(generator);
+                    if (iq < 0 || iq >= H || jq < 0 || jq >= W || (iq == i && jq == j) || !similar_hits(hit, hits[iq*W + jq])){
+                        continue;
+                    }
+                    used[n_used++] = iq*W + jq;
+                    const Reservoir &other = candidates[iq*W + jq];
+                    if (other.light >= 0){
+                        reservoir.merge(other, light_strength(Lights[other.light], hit.position, hit.normal), &generator);
+                    } else {
+                        reservoir.M += other.M;
+                    }
+                }
+                Vector color = hit.indirect;
+                if (reservoir.light >= 0){
+                    // Only the neighbours that could have picked the kept light count as candidates, otherwise lights
+                    // facing away from some neighbours would be darkened
+                    for (int n = 0; n < n_used; ++n){
+                        const PrimaryHit &other = hits[used[n]];
+                        if (!(light_strength(Lights[reservoir.light], other.position, other.normal) > 0)){
+                            reservoir.M -= candidates[used[n]].M;
+                        }
+                    }
+                    double target = light_strength(Lights[reservoir.light], hit.position, hit.normal);
+                    reservoir.finalize(target);
+                    Vector epsilon_above = hit.position + hit.normal * epsilon;
+                    Vector to_shadow = Lights[reservoir.light].position - epsilon_above;
+                    Ray shadow_ray = Ray(epsilon_above, to_shadow);
+                    double t = scene.has_motion ? t_gen(generator) : 0;
+                    if (reservoir.W > 0 && !scene_occluded(scene, shadow_ray, to_shadow.norm(), t)){
+                        color = color + (target * reservoir.W) * (hit.albedo/PI);
+                    }
+                }
+                Features features;
+                features.albedo = hit.albedo;
+                features.normal = hit.normal;
+                features.depth = hit.depth;
+                pixels[i*W + j].add(color, features);
+            }
+        });
+        std::swap(hits, previous_hits);
+
+        int current_perten = (10*(pass+1))/set->monte_carlo_size;
+        if (current_perten >= max_perten+1){
+            max_perten = current_perten;
+            std::cout << max_perten * 10 << "%, in " << (std::chrono::steady_clock::now() - start).count()/(double)pow(10, 9) << "s" << std::endl;
+        }
+    }
+}
+
+struct Checkpoint{
+    // Saved state of a progressive render, resuming from it gives the same image as a render that never stopped
+    // The random numbers of a sample only depend on the seed, the pixel and the pixel's sample count, so they are the whole RNG state
+    // File layout: Header then the width*height pixel accumulators
+    static constexpr char MAGIC[8] = {'R', 'T', 'C', 'K', 'P', '0', '0', '2'};
+    struct Header{
+        char magic[8];
+        uint64_t arguments_hash;    // a checkpoint only resumes a render with the same arguments
+        int32_t width, height;
+        uint32_t seed;
+        int32_t pass;               // next pass to render
+        double elapsed;             // seconds already rendered, they count in the time budget
+    };
+    Header header;
+    std::vector<PixelAccumulator> pixels;
+
+    bool load(const std::string& path, int width, int height){
+        // Only accepts a checkpoint of a width x height render, checked on the header before the pixels are allocated,
+        // and a file of exactly sizeof(Header) + width*height*sizeof(PixelAccumulator) bytes (no short read, nothing left after)
+        FILE* f = fopen(path.c_str(), "rb");
+        if (f == nullptr){return false;}
+        bool ok = fread(&header, sizeof(Header), 1, f) == 1 && memcmp(header.magic, MAGIC, 8) == 0 && header.width == width && header.height == height;
+        if (ok){
+            pixels.resize((size_t)width * height);
+            ok = fread(pixels.data(), sizeof(PixelAccumulator), pixels.size(), f) == pixels.size() && fgetc(f) == EOF;
+        }
+        fclose(f);
+        return ok;
+    }
+
+    bool save(const std::string& path) const {
+        // Written to a temporary file then renamed, a crash while saving leaves the previous checkpoint intact
+        std::string tmp_path = path + ".tmp";
+        FILE* f = fopen(tmp_path.c_str(), "wb");
+        if (f == nullptr){return false;}
+        bool ok = fwrite(&header, sizeof(Header), 1, f) == 1;
+        ok = ok && fwrite(pixels.data(), sizeof(PixelAccumulator), pixels.size(), f) == pixels.size();
+        ok = (fclose(f) == 0) && ok;
+        if (!ok){
+            remove(tmp_path.c_str());
+            return false;
+        }
+        return replace_file(tmp_path, path);
+    }
+};
+
+void render_progressive(Scene &scene, std::vector<Light> &Lights, int W, int H, std::vector<PixelAccumulator> &pixels_out, std::vector<unsigned char> &image, Settings *set, Checkpoint *resumed){
+    /*
+        Renders the whole image in passes, the samples of each pixel accumulating in a float framebuffer
+        In adaptive mode the first pass gives adaptive_min_samples samples to every pixel, the next ones as many again to the pixels whose
+        error estimate is still above adaptive_threshold, otherwise passes give one sample to every pixel
+        Passes stop once every pixel has monte_carlo_size samples, or with a time budget once it is spent (monte_carlo_size is then no limit)
+        The image so far is written to preview_file every save_passes passes and/or save_seconds seconds, along with a checkpoint if
+        checkpoint_file is set; resumed is the checkpoint to continue from, nullptr to start from scratch
+        The samples end in pixels_out, image only holds the previews
+    */
+    const size_t n_threads = set->n_threads;
+    const bool adaptive = set->adaptive_threshold > 0;
+    const bool budgeted = set->time_budget > 0;
+    const int max_samples = budgeted ? std::numeric_limits<int>::max() : set->monte_carlo_size;
+    const int batch = adaptive ? std::max(1, std::min(set->adaptive_min_samples, max_samples)) : 1;
+    Checkpoint state;
+    memcpy(state.header.magic, Checkpoint::MAGIC, 8);
+    state.header.arguments_hash = set->arguments_hash;
+    state.header.width = W;
+    state.header.height = H;
+    state.header.seed = set->seed;
+    state.header.pass = 0;
+    state.header.elapsed = 0;
+    state.pixels.resize(W * H);
+    if (resumed != nullptr){
+        state = *resumed;
+    }
+    std::vector<PixelAccumulator> &pixels = state.pixels;
+    std::vector<double> errors(W * H);
+    std::vector<int> row_sampled(H);
+    // Time already spent before a resume counts as if it had been spent in this run
+    std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now() - std::chrono::nanoseconds((long long)(state.header.elapsed*pow(10, 9)));
+    std::chrono::time_point<std::chrono::steady_clock> deadline = start + std::chrono::nanoseconds((long long)(set->time_budget*pow(10, 9)));
+    std::chrono::steady_clock::duration last_pass = std::chrono::steady_clock::duration::zero();
+    std::chrono::time_point<std::chrono::steady_clock> last_save = start;
+    int max_perten = 0;
+    for (int pass = state.header.pass; ; ++pass){
+        std::chrono::time_point<std::chrono::steady_clock> pass_start = std::chrono::steady_clock::now();
+        if (budgeted && pass > 0 && pass_start + last_pass > deadline){
+            break; // the next pass would not fit in the budget
+        }
+        for (int p = 0; p < W*H && adaptive; ++p){
+            errors[p] = pixels[p].error();
+        }
+        parallel_rows(H, n_threads, [&](int i){
+            std::unique_ptr<Sampler> sampler = make_sampler(set);
+            row_sampled[i] = 0;
+            for (int j = 0; j < W; ++j){
+                PixelAccumulator &pixel = pixels[i*W + j];
+                if (pixel.count >= max_samples){
+                    continue;
+                }
+                // The first pass always completes, so that no pixel is left black
+                if (budgeted && pass > 0 && std::chrono::steady_clock::now() > deadline){
+                    return;
+                }
+                if (adaptive){
+                    // A pixel stops with its 3x3 neighbourhood, the estimate of a single pixel is too often optimistic after few samples
+                    double error = 0;
+                    for (int iq = std::max(i-1, 0); iq <= std::min(i+1, H-1); ++iq){
+                        for (int jq = std::max(j-1, 0); jq <= std::min(j+1, W-1); ++jq){
+                            error = std::max(error, errors[iq*W + jq]);
+                        }
+                    }
+                    if (error < set->adaptive_threshold){
+                        continue;
+                    }
+                }
+                add_samples(scene, Lights, W, H, i, j, sampler.get(), set, pixel, std::min(batch, max_samples - pixel.count));
+                ++row_sampled[i];
+            }
+        });
+        last_pass = std::chrono::steady_clock::now() - pass_start;
+        int sampled = std::accumulate(row_sampled.begin(), row_sampled.end(), 0);
+        if (sampled == 0){
+            break;
+        }
+        double elapsed = (std::chrono::steady_clock::now() - start).count()/(double)pow(10, 9);
+        bool save_due = (set->save_passes > 0 && (pass+1) % set->save_passes == 0);
+        save_due = save_due || (set->save_seconds > 0 && (std::chrono::steady_clock::now() - last_save).count()/(double)pow(10, 9) >= set->save_seconds);
+        if (save_due){
+            resolve_image(pixel_means(pixels), image);
+            if (!write_png(set->preview_file, W, H, 3, &image[0])){
+                std::cout << "Error writing " << set->preview_file << std::endl;
+            }
+            if (!set->checkpoint_file.empty()){
+                state.header.pass = pass+1;
+                state.header.elapsed = (std::chrono::steady_clock::now() - start).count()/(double)pow(10, 9);
+                if (!state.save(set->checkpoint_file)){
+                    std::cout << "Error writing checkpoint " << set->checkpoint_file << std::endl;
+                }
+            }
+            last_save = std::chrono::steady_clock::now();
+        }
+        if (adaptive && !budgeted){
+            std::cout << "Pass " << pass << ": " << sampled << " pixels sampled, in " << elapsed << "s" << std::endl;
+        } else if (!budgeted){
+            if ((10*(pass+1))/max_samples > max_perten){
+                max_perten = (10*(pass+1))/max_samples;
+                std::cout << max_perten * 10 << "%, in " << elapsed << "s" << std::endl;
+            }
+        } else if ((int)(10*elapsed/set->time_budget) > max_perten){
+            max_perten = std::min(10, (int)(10*elapsed/set->time_budget));
+            std::cout << max_perten * 10 << "% of the time budget, " << pass+1 << " passes" << std::endl;
+        }
+    }
+
+    long long total = 0;
+    int most = 1;
+    for (int p = 0; p < W*H; ++p){
+        total += pixels[p].count;
+        most = std::max(most, pixels[p].count);
+    }
+    std::cout << "Average of " << (double)total/(W*H) << " samples per pixel" << std::endl;
+
+    if (!set->sample_map.empty()){
+        // White for the most sampled pixels
+        std::vector<unsigned char> counts(W * H);
+        for (int p = 0; p < W*H; ++p){
+            counts[p] = (255LL*pixels[p].count)/most;
+        }
+        write_png(set->sample_map, W, H, 1, &counts[0]);
+    }
+    pixels_out = std::move(pixels);
+}
+
+double luminance(const Vector& color){
+    return 0.2126*color[0] + 0.7152*color[1] + 0.0722*color[2];
+}
+
+std::vector<Vector> denoise(const std::vector<PixelAccumulator> &pixels, int W, int H, int iterations, size_t n_threads){
+    /*
+        Edge-avoiding a-trous wavelet filter (Dammertz et al., with the edge stopping functions of SVGF): iterations passes of a 5x5
+        B3 spline kernel whose taps are 1, 2, 4... pixels apart, each tap weighted down by the differences of normal, depth (relative to
+        the local depth gradient) and luminance (relative to its estimated standard deviation) with the center pixel
+        Colors are divided by the albedo before filtering and multiplied back after, so textures stay sharp
+        Pixels whose paths found no diffuse surface are left as they are
+    */
+    const double sigma_normal = 128;
+    const double sigma_coherence = 32;
+    const double sigma_depth = 1;
+    const double sigma_luminance = 2;
+    const double kernel[5] = {1.0/16, 1.0/4, 3.0/8, 1.0/4, 1.0/16};
+    std::vector<Vector> albedo(W * H);
+    std::vector<Vector> normal(W * H);
+    std::vector<double> coherence(W * H);      // length of the mean normal, below 1 when the samples of the pixel saw different surfaces
+    std::vector<double> depth(W * H);
+    std::vector<bool> valid(W * H);
+    std::vector<Vector> illumination(W * H);
+    std::vector<double> variance(W * H);
+    for (int p = 0; p < W*H; ++p){
+        Features features = pixels[p].mean_features();
+        valid[p] = features.normal.norm2() > 0;
+        // Albedo as a factor, floored so that dark surfaces don't blow up their noise
+        for (int c = 0; c < 3; ++c){
+            albedo[p][c] = valid[p] ? std::max(features.albedo[c]/255, 0.01) : 1;
+        }
+        coherence[p] = features.normal.norm();
+        normal[p] = valid[p] ? features.normal/coherence[p] : features.normal;
+        depth[p] = features.depth;
+        Vector mean = pixels[p].mean();
+        illumination[p] = Vector(mean[0]/albedo[p][0], mean[1]/albedo[p][1], mean[2]/albedo[p][2]);
+        // Variance of the mean, per channel then combined with the luminance weights
+        int count = pixels[p].count;
+        variance[p] = -1;
+        if (count >= 4){
+            double luminance_variance = 0;
+            const double weights[3] = {0.2126, 0.7152, 0.0722};
+            for (int c = 0; c < 3; ++c){
+                double channel = std::max(0.0, (pixels[p].sum2[c] - count*mean[c]*mean[c])/(count - 1))/count;
+                luminance_variance += weights[c]*weights[c]*channel/(albedo[p][c]*albedo[p][c]);
+            }
+            variance[p] = luminance_variance;
+        }
+    }
+    // Too few samples for a per pixel estimate: the spread of the luminance over the valid 3x3 neighbourhood stands for it
+    std::vector<double> spatial(W * H);
+    parallel_rows(H, n_threads, [&](int i){
+        for (int j = 0; j < W; ++j){
+            int p = i*W + j;
+            if (variance[p] >= 0){
+                continue;
+            }
+            double sum = 0, sum2 = 0;
+            int n = 0;
+            for (int iq = std::max(i-1, 0); iq <= std::min(i+1, H-1); ++iq){
+                for (int jq = std::max(j-1, 0); jq <= std::min(j+1, W-1); ++jq){
+                    if (valid[iq*W + jq] == valid[p]){
+                        double l = luminance(illumination[iq*W + jq]);
+                        sum += l;
+                        sum2 += l*l;
+                        ++n;
+                    }
+                }
+            }
+            spatial[p] = std::max(0.0, sum2/n - (sum/n)*(sum/n));
+        }
+    });
+    for (int p = 0; p < W*H; ++p){
+        if (variance[p] < 0){
+            variance[p] = spatial[p];
+        }
+    }
+    // Depth change per pixel, for the depth weight of taps further away
+    std::vector<double> depth_gradient(W * H);
+    for (int i = 0; i < H; ++i){
+        for (int j = 0; j < W; ++j){
+            double dx = (depth[i*W + std::min(j+1, W-1)] - depth[i*W + std::max(j-1, 0)])/2;
+            double dy = (depth[std::min(i+1, H-1)*W + j] - depth[std::max(i-1, 0)*W + j])/2;
+            depth_gradient[i*W + j] = std::max(abs(dx), abs(dy));
+        }
+    }
+
+    std::vector<Vector> next_illumination(W * H);
+    std::vector<double> next_variance(W * H);
+    std::vector<double> blurred_variance(W * H);
+    for (int iteration = 0; iteration < iterations; ++iteration){
+        int step = 1 << iteration;
+        // The luminance weight uses a 3x3 blurred variance, less noisy than the pixel's own
+        parallel_rows(H, n_threads, [&](int i){
+            for (int j = 0; j < W; ++j){
+                double sum = 0, weights = 0;
+                for (int di = -1; di <= 1; ++di){
+                    for (int dj = -1; dj <= 1; ++dj){
+                        int iq = i + di, jq = j + dj;
+                        if (iq >= 0 && iq < H && jq >= 0 && jq < W){
+                            double weight = (2 - abs(di)) * (2 - abs(dj));
+                            sum += weight * variance[iq*W + jq];
+                            weights += weight;
+                        }
+                    }
+                }
+                blurred_variance[i*W + j] = sum/weights;
+            }
+        });
+        parallel_rows(H, n_threads, [&](int i){
+            for (int j = 0; j < W; ++j){
+                int p = i*W + j;
+                if (!valid[p]){
+                    next_illumination[p] = illumination[p];
+                    next_variance[p] = variance[p];
+                    continue;
+                }
+                double luminance_p = luminance(illumination[p]);
+                double luminance_scale = sigma_luminance * sqrt(blurred_variance[p]) + 1e-10;
+                Vector sum = Vector(0,0,0);
+                double sum_variance = 0;
+                double weights = 0;
+                for (int di = -2; di <= 2; ++di){
+                    for (int dj = -2; dj <= 2; ++dj){
+                        int iq = i + di*step, jq = j + dj*step;
+                        if (iq < 0 || iq >= H || jq < 0 || jq >= W || !valid[iq*W + jq]){
+                            continue;
+                        }
+                        int q = iq*W + jq;
+                        double weight_normal = pow(std::max(0.0, dot(normal[p], normal[q])), sigma_normal);
+                        // Pixels mixing surfaces (edges, glass, defocus and motion blur) neither take from nor give to their neighbours:
+                        // their color isn't their mean albedo times an illumination, replacing the latter with a neighbour's moves edges
+                        if (q != p){
+                            weight_normal *= pow(coherence[p]*coherence[q], sigma_coherence);
+                        }
+                        double distance = step * sqrt(di*di + dj*dj);
+                        double weight_depth = exp(-abs(depth[p] - depth[q])/(sigma_depth * depth_gradient[p] * distance + 1e-10));
+                        double weight_luminance = exp(-abs(luminance_p - luminance(illumination[q]))/luminance_scale);
+                        double weight = kernel[di + 2] * kernel[dj + 2] * weight_normal * weight_depth * weight_luminance;
+                        sum = sum + illumination[q] * weight;
+                        sum_variance += weight * weight * variance[q];
+                        weights += weight;
+                    }
+                }
+                // The center tap always has weight kernel[2]^2 > 0
+                next_illumination[p] = sum/weights;
+                next_variance[p] = sum_variance/(weights*weights);
+            }
+        });
+        std::swap(illumination, next_illumination);
+        std::swap(variance, next_variance);
+    }
+
+    std::vector<Vector> colors(W * H);
+    for (int p = 0; p < W*H; ++p){
+        colors[p] = product_element_wise(illumination[p], albedo[p]);
+    }
+    return colors;
+}
+
+void write_features(const std::vector<PixelAccumulator> &pixels, int W, int H, const std::string& prefix){
+    // prefix_albedo.png, prefix_normal.png (components from [-1, 1] to [0, 255]) and prefix_depth.png (white is the nearest)
+    std::vector<unsigned char> albedo(W * H * 3), normal(W * H * 3), depth(W * H);
+    double max_depth = 0;
+    for (int p = 0; p < W*H; ++p){
+        max_depth = std::max(max_depth, pixels[p].mean_features().depth);
+    }
+    for (int p = 0; p < W*H; ++p){
+        Features features = pixels[p].mean_features();
+        for (int c = 0; c < 3; ++c){
+            albedo[p*3 + c] = std::min(255.0, std::max(0.0, features.albedo[c]));
+            normal[p*3 + c] = std::min(255.0, std::max(0.0, (features.normal[c] + 1)*127.5));
+        }
+        depth[p] = (features.depth > 0 && max_depth > 0) ? 255*(1 - features.depth/max_depth) : 0;
+    }
+    bool ok = write_png(prefix + "_albedo.png", W, H, 3, &albedo[0]);
+    ok = write_png(prefix + "_normal.png", W, H, 3, &normal[0]) && ok;
+    ok = write_png(prefix + "_depth.png", W, H, 1, &depth[0]) && ok;
+    if (!ok){
+        std::cout << "Error writing the feature buffers " << prefix << "_*.png" << std::endl;
     }
-    
-    for (int i = pow(size_side, 2); i<set->monte_carlo_size; ++i){
-        r1v[i] = udis(*generator);
-        r2v[i] = udis(*generator);
-    }
-
-    double di, dj, r, theta, t;
-    std::uniform_real_distribution<double> r_squared(0, pow(set->DOF_radius, 2));
-    std::uniform_real_distribution<double> theta_gen(0, 2*PI);
-    std::uniform_real_distribution<double> t_gen(0, 1);
-    Vector P;
-    for (int i=0; i<set->monte_carlo_size; ++i){
-        r1 = udis(*generator);
-        r2 = udis(*generator);
-        di = set->antialiasing_strength * sqrt(-2*log(r1)) * cos(2*PI*r2);
-        dj = set->antialiasing_strength * sqrt(-2*log(r1)) * sin(2*PI*r2);
-        Ray pr = pixel_ray(W, H, ir+di, jr+dj);
-        if (set->DOF_dist > 0){
-            P = pr.origin + pr.unit * set->DOF_dist/abs(pr.unit.data[2]);
-            r = sqrt(r_squared(*generator));
-            theta = theta_gen(*generator);
-            pr.origin = pr.origin + Vector(r*cos(theta), r*sin(theta), 0);
-            pr.unit = P - pr.origin;
-            pr.unit.normalize();
-        }
-        t = t_gen(*generator);
-        color = color + get_color_aux(Scene, Lights, pr, set->reflections_depth, set->ray_depth, r1v[i], r2v[i], t, generator);
-    }
-    return color/set->monte_carlo_size;
 }
 
-void concurrent_line(std::vector<Geometry*> Scene, std::vector<Light> Lights, int W, int H, int i0, size_t block_size, std::vector<unsigned char> &image, Settings* set){
-    std::hash<std::thread::id> hasher;
-    static thread_local std::mt19937 generator = std::mt19937(clock() + hasher(std::this_thread::get_id()));
+void concurrent_line(Scene &scene, std::vector<Light> Lights, int W, int H, int i0, size_t block_size, std::vector<PixelAccumulator> &pixels, Settings* set){
+    std::unique_ptr<Sampler> sampler = make_sampler(set);
     for (size_t i = i0; i < i0+block_size; ++i){
         for (int j = 0; j < W; ++j) {
-            Vector color = get_color(Scene, Lights, W, H, i, j, &generator, set);
-
-            gamma_correction(color);
-            image[(i * W + j) * 3 + 0] = color.data[0];
-            image[(i * W + j) * 3 + 1] = color.data[1];
-            image[(i * W + j) * 3 + 2] = color.data[2];
+            add_samples(scene, Lights, W, H, i, j, sampler.get(), set, pixels[i*W + j], set->monte_carlo_size);
         }
     }
 }
@@ -1110,6 +3646,113 @@ bool parse_double(double &value, char arg[]){
     }
 }
 
+bool parse_options(int &argc, char* argv[], Settings &set){
+    // Consumes the '--name value' options, the positional arguments are kept in argv for main
+    // The arguments that change the image are hashed into set.arguments_hash
+    int kept = 1;
+    std::string identity;
+    for (int i=1; i<argc; ++i){
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) != 0){
+            argv[kept++] = argv[i];
+            identity += arg + " ";
+            continue;
+        }
+        if (i+1 >= argc){
+            std::cout << "Missing value for option " << arg << std::endl;
+            return false;
+        }
+        char* value = argv[++i];
+        if (arg != "--checkpoint" && arg != "--resume" && arg != "--seed" && arg != "--save-passes" && arg != "--save-seconds" && arg != "--preview" && arg != "--spp-map" && arg != "--denoise" && arg != "--features"){
+            identity += arg + " " + value + " ";
+        }
+        bool parsed;
+        if (arg == "--bake"){
+            parsed = parse_int(set.bake_resolution, value);
+        } else if (arg == "--rr-depth"){
+            parsed = parse_int(set.roulette_depth, value);
+        } else if (arg == "--restir"){
+            parsed = parse_int(set.restir_candidates, value);
+        } else if (arg == "--env"){
+            set.environment_map = value;
+            parsed = true;
+        } else if (arg == "--env-intensity"){
+            parsed = parse_double(set.environment_intensity, value);
+        } else if (arg == "--adaptive"){
+            parsed = parse_double(set.adaptive_threshold, value);
+        } else if (arg == "--min-spp"){
+            parsed = parse_int(set.adaptive_min_samples, value);
+        } else if (arg == "--time-budget"){
+            parsed = parse_double(set.time_budget, value);
+        } else if (arg == "--save-passes"){
+            parsed = parse_int(set.save_passes, value);
+        } else if (arg == "--save-seconds"){
+            parsed = parse_double(set.save_seconds, value);
+        } else if (arg == "--preview"){
+            set.preview_file = value;
+            parsed = true;
+        } else if (arg == "--checkpoint"){
+            set.checkpoint_file = value;
+            parsed = true;
+        } else if (arg == "--resume"){
+            set.checkpoint_file = value;
+            set.resume = true;
+            parsed = true;
+        } else if (arg == "--seed"){
+            int seed;
+            parsed = parse_int(seed, value);
+            set.seed = seed;
+        } else if (arg == "--spp-map"){
+            set.sample_map = value;
+            parsed = true;
+        } else if (arg == "--denoise"){
+            parsed = parse_int(set.denoise_iterations, value);
+        } else if (arg == "--features"){
+            set.feature_prefix = value;
+            parsed = true;
+        } else if (arg == "--cache"){
+            parsed = parse_double(set.cache_cell, value);
+        } else if (arg == "--cache-samples"){
+            parsed = parse_int(set.cache_samples, value);
+        } else if (arg == "--sampler"){
+            set.sampler = value;
+            parsed = (set.sampler == "sobol" || set.sampler == "halton" || set.sampler == "cmj" || set.sampler == "random");
+        } else {
+            std::cout << "Unknown option " << arg << std::endl;
+            return false;
+        }
+        if (!parsed){
+            std::cout << "Error parsing value of option " << arg << std::endl;
+            return false;
+        }
+    }
+    // ReSTIR renders its own passes over the whole image, the sampling modes below don't apply to it
+    if (set.restir_candidates > 0 && set.adaptive_threshold > 0){
+        std::cout << "Option --restir can't be combined with --adaptive" << std::endl;
+        return false;
+    }
+    if (set.restir_candidates > 0 && set.time_budget > 0){
+        std::cout << "Option --restir can't be combined with --time-budget" << std::endl;
+        return false;
+    }
+    if (set.restir_candidates > 0 && (set.save_passes > 0 || set.save_seconds > 0)){
+        std::cout << "Option --restir can't be combined with --save-passes or --save-seconds" << std::endl;
+        return false;
+    }
+    if (set.restir_candidates > 0 && !set.checkpoint_file.empty()){
+        std::cout << "Option --restir can't be combined with --checkpoint or --resume" << std::endl;
+        return false;
+    }
+    // The irradiance cache is not saved in checkpoints, a resumed render would restart it empty and differ from an uninterrupted one
+    if (set.cache_cell > 0 && !set.checkpoint_file.empty()){
+        std::cout << "Option --cache can't be combined with --checkpoint or --resume" << std::endl;
+        return false;
+    }
+    argc = kept;
+    set.arguments_hash = hash_string(identity);
+    return true;
+}
+
 int main(int argc, char* argv[]){
     std::chrono::time_point<std::chrono::steady_clock> realstart;
     realstart = std::chrono::steady_clock::now();
@@ -1117,9 +3760,13 @@ int main(int argc, char* argv[]){
     Settings set = Settings();
     int W = 512;
     int H = 512;
+    bool soft_lights = false;
 
     // Arguments: 
     std::cout << std::endl;
+    if (!parse_options(argc, argv, set)){
+        return 1;
+    }
     if (argc < 2){std::cout << "Executing with default settings (default hardcoded settings may be very off depending on the scene, consider adjusting them) (run with argument 'help' for help)" << std::endl;}
     else if (argc == 9){
         if (!(parse_int(W, argv[1]) && parse_int(H, argv[2]) && parse_int(set.reflections_depth, argv[3]) && parse_int(set.ray_depth, argv[4]) && parse_int(set.monte_carlo_size, argv[5]) && parse_double(set.DOF_dist, argv[6]) && parse_double(set.DOF_radius, argv[7]) && parse_double(set.antialiasing_strength, argv[8]))){
@@ -1138,9 +3785,18 @@ int main(int argc, char* argv[]){
             W = 1024;
             H = 1024;
             std::cout << "Rendering with configuration: render" << std::endl;
+        } else if (arg == "soft"){
+            set.ray_depth = 3;
+            set.monte_carlo_size = 64;
+            soft_lights = true;
+            std::cout << "Rendering with configuration: soft" << std::endl;
+        } else if (arg == "perlin_bench"){
+            perlin_benchmark();
+            return 0;
         } else if (arg == "help") {
-            std::cout << "Correct use: no arguments or 'str configuration_name' or 'int reflections_depth, int ray_depth, int monte_carlo_size, double DOF_dist, double DOF_radius, double antialiasing_strength'" << std::endl;
+            std::cout << "Correct use: no arguments or 'str configuration_name' (debug, render, soft, perlin_bench) or 'int reflections_depth, int ray_depth, int monte_carlo_size, double DOF_dist, double DOF_radius, double antialiasing_strength'" << std::endl;
             std::cout << "\nWidth, Height: the picture's dimensions in pixels, PREFER MULTIPLES OF 32 FOR H (heavy on performance, ~bilinear cost)\nReflections depth: number of refractions and reflections computed before counting the ray as black (heavy on performance only on mirror/lens-intensive scenes)\nRay depth: number of indirect light bounces computed before direct lighting (intensive on perfomance, ~linear cost)\nMonte-carlo size: number of rays on which to average each pixel, reduces noise, PREFER PERFECT SQUARES (heavy on performance, ~linear cost)\nDepth of field distance: distance of the point of focus (no impact on performance)\nDepth of field radius: strength of the depth of field effect (no impact on performance)\nAntialiasing strength: strength of antialiasing effect, may induce blur (no impact on performance)" << std::endl;
+            std::cout << "\nOptions (anywhere on the command line):\n--bake N: bake procedural textures once per object on a grid of N voxels along its largest side (3 floats per voxel) instead of evaluating them at every hit\n--rr-depth N: diffuse bounces before russian roulette may end a path, allows a high ray depth at a lower average cost (default 3, -1 disables it)\n--restir M: resample the direct lighting of primary hits from M light candidates per sample, reused across neighbouring pixels and successive samples, with one shadow ray per pixel and sample (default 0, off)\n--env FILE: light the scene with an equirectangular HDR environment map, the walls and ceiling of the room are then left out\n--env-intensity X: multiplier of the environment map, a radiance of 1 shows as white (default 1)\n--adaptive E: stop sampling a pixel once the standard error of its output is below E levels (out of 255), monte-carlo size becomes the maximum number of samples (default 0, off)\n--min-spp N: samples per pixel before the first error estimate, and per round after it, in adaptive mode (default 16)\n--spp-map FILE: write the number of samples taken per pixel as a grayscale image, white being the most sampled pixels, in adaptive or time budget mode\n--time-budget S: render passes over the whole image for about S seconds (at least one sample per pixel) and write the image at that point, monte-carlo size is then no limit\n--save-passes N, --save-seconds S: render progressively, one sample per pixel per pass, and write the image so far every N passes and/or S seconds\n--preview FILE: file written during progressive rendering (default image.png, the final output)\n--checkpoint FILE: render progressively and save the render state to FILE with each intermediate image (every 60s if no --save option is given)\n--resume FILE: continue the render saved in FILE, with the same arguments otherwise, the result is the same as without interruption (except with a time budget)\n--seed N: seed of the random choices, renders with the same seed and arguments give the same image (default 0, random)\n--sampler NAME: numbers the paths of a pixel are built from, sobol (Owen scrambled), halton (scrambled), cmj (correlated multi-jittered) or random (default sobol)\n--denoise N: filter the final image with N passes of an edge-avoiding a-trous wavelet guided by the first hit albedo, normal and depth, 5 covers 61x61 pixels (default 0, off)\n--features PREFIX: also write the first hit albedo, normal and depth as PREFIX_albedo.png, PREFIX_normal.png and PREFIX_depth.png\n--cache SIZE: end the paths after their first diffuse bounce on an irradiance cache, a grid of SIZE wide cells filled by the other paths, faster on diffuse scenes but biased and not reproducible from the seed, not available with --checkpoint or --resume (default 0, off)\n--cache-samples N: paths recorded in a cache cell before it is used, more is smoother and slower (default 16)" << std::endl;
             return 0;
         } else {
             std::cout << "Error parsing argument, unknown configuration name: " << argv[1] << std::endl;
@@ -1153,81 +3809,161 @@ int main(int argc, char* argv[]){
 
     std::cout << "Width: " << W << std::endl << "Height: " << H << std::endl << "Reflections depth: " << set.reflections_depth << std::endl << "Ray depth: " << set.ray_depth << std::endl << "Monte-carlo size: " << set.monte_carlo_size << std::endl << "Depth of Field distance: " << set.DOF_dist << std::endl << "Depth of Field radius: " << set.DOF_radius << std::endl << "Antialiasing strength: " << set.antialiasing_strength << std::endl;
 
+    Checkpoint checkpoint;
+    if (set.resume){
+        if (!checkpoint.load(set.checkpoint_file, W, H)){
+            std::cout << "Error reading checkpoint " << set.checkpoint_file << ", it is missing, damaged or of another image size" << std::endl;
+            return 1;
+        }
+        if (checkpoint.header.arguments_hash != set.arguments_hash){
+            std::cout << "Checkpoint " << set.checkpoint_file << " was saved by a render with other arguments" << std::endl;
+            return 1;
+        }
+        if (set.seed != 0 && set.seed != checkpoint.header.seed){
+            std::cout << "Warning: --seed " << set.seed << " is replaced by the seed " << checkpoint.header.seed << " of the checkpoint" << std::endl;
+        }
+        set.seed = checkpoint.header.seed;
+        std::cout << "Resuming from pass " << checkpoint.header.pass << " of " << set.checkpoint_file << std::endl;
+    }
+    if (set.seed == 0){
+        set.seed = std::random_device()() | 1;
+    }
+    if (!set.checkpoint_file.empty() && set.save_passes == 0 && set.save_seconds == 0){
+        set.save_seconds = 60;
+    }
+
     Vector empty_vec = Vector(-1, -1, -1);
     std::vector<Procedural*> procedurals{new Perlin(Vector(100,100,100), Vector(100,130,130))}; // Pattern repeats every multiple of "dimensions". If it intersects an object, set it much lower to get more uniform repetition
 
     // The SHUTTER TIME for motion blur is always 1 (so movement between t=0 and t=1)
-    std::vector<Geometry*> Scene{new Sphere(Vector(0,-6,0), 3, Vector(170, 10, 170)),        // center ball
-                                new Sphere(Vector(0, 1000, 0), 940, Vector(255, 0, 0)),     // top red
-                                new Sphere(Vector(0, 0, -1000), 940, Vector(0, 255, 0)),    // end green
-                                new Sphere(Vector(0, -1000, 0), 990, Vector(0, 0, 255)),    // bottom blue
-                                new Sphere(Vector(0, 0, 1000), 940, Vector(132, 46, 27)),   // back brown
-                                new Sphere(Vector(1000, 0, 0), 940, Vector(255, 0, 255)),   // right pink
-                                new Sphere(Vector(-1000, 0, 0), 940, Vector(255, 255, 0)),  // left orange
-                                new Sphere(Vector(11, 15, -10), 3, Vector(64, 224, 208), -1, &throw_movement),      // small turquoise (ninja)
-                                new Sphere(Vector(-20, 21, -15), 10, empty_vec, 0),         // left mirror
-                                new Sphere(Vector(-9, 1, 30), 3.5, empty_vec, 1.49),         // left lens
-                                new Sphere(Vector(-9, -7, 30), 3.5, empty_vec, -1, &constant_position, procedurals[0]),         // left proce
-                                new TriangleMesh("cat.obj", "cat_diff.png", Vector(0, -10, 0), 0.6),
-                                new TriangleMesh("cat.obj", "cat_diff.png", Vector(12, -10, 13), 0.25, &constant_position, procedurals[0])
-                                };
+    Scene scene;
+    scene.add(SphereSet({Sphere(Vector(0,-6,0), 3, Vector(170, 10, 170)),      // center ball
+                         Sphere(Vector(-20, 21, -15), 10, empty_vec, 0),      // left mirror
+                         Sphere(Vector(-9, 1, 30), 3.5, empty_vec, 1.49)}),   // left lens
+              Plane(Vector(0, -10, 0), Vector(0, 1, 0), Vector(0, 0, 255)),     // bottom blue
+              Sphere(Vector(11, 15, -10), 3, Vector(64, 224, 208), -1, &throw_movement),      // small turquoise (ninja)
+              Sphere(Vector(-9, -7, 30), 3.5, empty_vec, -1, &constant_position, procedurals[0]),         // left proce
+              TriangleMesh("cat.obj", "cat_diff.png", Vector(0, -10, 0), 0.6),
+              TriangleMesh("cat.obj", "cat_diff.png", Vector(12, -10, 13), 0.25, &constant_position, procedurals[0]));
+    if (set.environment_map.empty()){
+        scene.add(Plane(Vector(0, 60, 0), Vector(0, -1, 0), Vector(255, 0, 0)),     // top red
+                  Plane(Vector(0, 0, -60), Vector(0, 0, 1), Vector(0, 255, 0)),     // end green
+                  Plane(Vector(0, 0, 60), Vector(0, 0, -1), Vector(132, 46, 27)),   // back brown
+                  Plane(Vector(60, 0, 0), Vector(-1, 0, 0), Vector(255, 0, 255)),   // right pink
+                  Plane(Vector(-60, 0, 0), Vector(1, 0, 0), Vector(255, 255, 0)));  // left orange
+    } else {
+        // Open scene lit by the sky
+        scene.environment = std::make_unique<EnvironmentMap>(set.environment_map.c_str(), set.environment_intensity);
+    }
     std::vector<Light> Lights{  {Vector(-10, 20, 40), 4*10000000},
                                 {Vector(20, 3, 15), 3*1000000}
                                 };
+    if (soft_lights){
+        // Area lights instead of the point lights: a ceiling panel and a small glowing ball
+        Lights.clear();
+        scene.add(emissive(Quad(Vector(-15, 59, -15), Vector(30, 0, 0), Vector(0, 0, 30), Vector(255, 255, 255)), uvec(2000000)),
+                  emissive(Sphere(Vector(20, 3, 15), 1.5, Vector(255, 255, 255)), Vector(3000000, 2000000, 1000000)));
+    }
 
-    place_camera_scene(Scene, Lights, Vector(0, 0, 55));
+    place_camera_scene(scene, Lights, Vector(0, 0, 55));
+    scene.prepare();
+    scene.light_tree.build(Lights);
+    if (set.cache_cell > 0){
+        scene.irradiance_cache = std::make_unique<IrradianceCache>(set.cache_cell, set.cache_samples);
+    }
  
     std::vector<unsigned char> image(W * H * 3, 0);
-    const size_t n_threads = 32;
+    std::vector<PixelAccumulator> pixels(W * H);
+    const size_t n_threads = set.n_threads;
     const size_t block_size = H / n_threads;
     std::vector<std::thread> threads(n_threads-1);
     
     std::cout << "Each " << n_threads << " thread manages " << block_size << " lines, and the main thread " << H - ((n_threads-1)*block_size) << " lines." << std::endl;
 
-    // Initialize procedurals
-    std::hash<std::thread::id> hasher;
-    static thread_local std::mt19937 generator = std::mt19937(clock() + hasher(std::this_thread::get_id()));
+    // Initialize procedurals, from the render's seed so that a resumed render sees the same patterns
+    std::mt19937 procedural_generator(set.seed);
     for (size_t i=0; i<procedurals.size(); ++i){
-        procedurals[i]->initialize(&generator);
+        procedurals[i]->initialize(&procedural_generator);
+    }
+    if (set.bake_resolution > 0){
+        std::chrono::time_point<std::chrono::steady_clock> bake_start = std::chrono::steady_clock::now();
+        scene.for_each([&](Geometry& object){
+            if (object.procedural != nullptr){
+                Vector pmin, pmax;
+                object.world_bounds(pmin, pmax);
+                Vector extent = pmax - pmin;
+                if (!(std::isfinite(extent[0]) && std::isfinite(extent[1]) && std::isfinite(extent[2]))){
+                    return; // planes are unbounded, their procedural stays evaluated at every hit
+                }
+                // Margin so positions slightly outside (epsilon, rounding) still interpolate inside the grid
+                Vector margin = (pmax - pmin)*0.01;
+                object.procedural = new BakedProcedural(object.procedural, pmin - margin, pmax + margin, set.bake_resolution);
+                procedurals.push_back(object.procedural);
+            }
+        });
+        std::cout << "Baked procedurals in " << (std::chrono::steady_clock::now() - bake_start).count()/(double)pow(10, 9) << "s" << std::endl;
     }
 
 
-    for (size_t i = 0; i < n_threads-1; ++i) {
-        threads[i] = std::thread(&concurrent_line, Scene, Lights, W, H, i*block_size, block_size, std::ref(image), &set);
-    }
+    if (set.restir_candidates > 0){
+        std::cout << "Resampling direct lighting from " << set.restir_candidates << " light candidates per sample, progress (by steps of 10%):" << std::endl;
+        render_restir(scene, Lights, W, H, pixels, &set);
+    } else if (set.adaptive_threshold > 0 || set.time_budget > 0 || set.save_passes > 0 || set.save_seconds > 0 || !set.checkpoint_file.empty()){
+        if (set.time_budget > 0){
+            std::cout << "Progressive rendering for " << set.time_budget << "s:" << std::endl;
+        } else if (set.adaptive_threshold > 0){
+            std::cout << "Adaptive sampling, between " << set.adaptive_min_samples << " and " << set.monte_carlo_size << " samples per pixel:" << std::endl;
+        } else {
+            std::cout << "Progressive rendering of " << set.monte_carlo_size << " passes:" << std::endl;
+        }
+        render_progressive(scene, Lights, W, H, pixels, image, &set, set.resume ? &checkpoint : nullptr);
+    } else {
+        for (size_t i = 0; i < n_threads-1; ++i) {
+            threads[i] = std::thread(&concurrent_line, std::ref(scene), Lights, W, H, i*block_size, block_size, std::ref(pixels), &set);
+        }
     
-    std::cout << "Main thread progress (by steps of 10%):" << std::endl;
-    int max_perten = 0;
-    int lines_count = 0;
-    std::chrono::time_point<std::chrono::steady_clock> start;
-    start = std::chrono::steady_clock::now();
-    for (int i = (n_threads-1)*block_size; i < H; ++i){
-        for (int j = 0; j < W; ++j) {
-            Vector color = get_color(Scene, Lights, W, H, i, j, &generator, &set);
-
-            gamma_correction(color);
-            image[(i * W + j) * 3 + 0] = color.data[0];
-            image[(i * W + j) * 3 + 1] = color.data[1];
-            image[(i * W + j) * 3 + 2] = color.data[2];
+        std::cout << "Main thread progress (by steps of 10%):" << std::endl;
+        int max_perten = 0;
+        int lines_count = 0;
+        std::chrono::time_point<std::chrono::steady_clock> start;
+        start = std::chrono::steady_clock::now();
+        std::unique_ptr<Sampler> sampler = make_sampler(&set);
+        for (int i = (n_threads-1)*block_size; i < H; ++i){
+            for (int j = 0; j < W; ++j) {
+                add_samples(scene, Lights, W, H, i, j, sampler.get(), &set, pixels[i*W + j], set.monte_carlo_size);
+            }
+            lines_count += 1;
+            int current_perten = (10*lines_count)/(H - ((n_threads-1)*block_size));
+            if (current_perten >= max_perten+1){
+                max_perten = current_perten;
+                std::cout << max_perten * 10 << "%, in " << (std::chrono::steady_clock::now() - start).count()/(double)pow(10, 9) << "s" << std::endl;
+            }
         }
-        lines_count += 1;
-        int current_perten = (10*lines_count)/(H - ((n_threads-1)*block_size));
-        if (current_perten >= max_perten+1){
-            max_perten = current_perten;
-            std::cout << max_perten * 10 << "%, in " << (std::chrono::steady_clock::now() - start).count()/(double)pow(10, 9) << "s" << std::endl;
+
+        std::cout << "Main thread joined, waiting for other threads (may take some time depending on the scene)." << std::endl;
+        for (size_t i = 0; i < n_threads-1; ++i){
+            threads[i].join();
         }
     }
 
-    std::cout << "Main thread joined, waiting for other threads (may take some time depending on the scene)." << std::endl;
-    for (size_t i = 0; i < n_threads-1; ++i){
-        threads[i].join();
+    if (scene.irradiance_cache){
+        size_t cells;
+        uint64_t lookups, hits;
+        scene.irradiance_cache->statistics(cells, lookups, hits);
+        std::cout << "Irradiance cache: " << cells << " cells, " << hits << " hits out of " << lookups << " lookups (" << 100.0*hits/std::max(lookups, (uint64_t)1) << "%)" << std::endl;
     }
-
-    stbi_write_png("image.png", W, H, 3, &image[0], 0);
-
-    for (size_t i = 0; i<Scene.size(); ++i){
-        delete Scene[i];
+    if (!set.feature_prefix.empty()){
+        write_features(pixels, W, H, set.feature_prefix);
+    }
+    if (set.denoise_iterations > 0){
+        std::chrono::time_point<std::chrono::steady_clock> denoise_start = std::chrono::steady_clock::now();
+        resolve_image(denoise(pixels, W, H, set.denoise_iterations, n_threads), image);
+        std::cout << "Denoised in " << (std::chrono::steady_clock::now() - denoise_start).count()/(double)pow(10, 9) << "s" << std::endl;
+    } else {
+        resolve_image(pixel_means(pixels), image);
     }
+    write_png("image.png", W, H, 3, &image[0]);
+
     for (size_t i = 0; i<procedurals.size(); ++i){
         delete procedurals[i];
     }